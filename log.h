@@ -0,0 +1,203 @@
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * @file log.h
+ * @brief Log events, their text and binary log file format
+ *
+ * Shared by proj2 (which writes events) and proj2-render (which turns binary
+ * log into the text of proj2.out).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Magic bytes at the start of binary log
+#define LOG_MAGIC "H2OLOG2"
+
+// Binary log file name
+#define LOG_BINARY_FILE "proj2.bin"
+
+// Atom events (one log line each)
+typedef enum {
+    EVENT_STARTED,     // "started"
+    EVENT_QUEUE,       // "going to queue"
+    EVENT_CREATING,    // "creating molecule M"
+    EVENT_CREATED,     // "molecule M created"
+    EVENT_NOT_ENOUGH,  // "not enough H" / "not enough O or H"
+    EVENT_COUNT        // NOT FOR REAL USE! Just a count of all events
+} log_event_t;
+
+// Maximal number of atom types in one recipe
+#define LOG_MAX_KINDS 8
+
+// Maximal length of "not enough" text including terminating NUL
+#define LOG_NOT_ENOUGH_MAX 64
+
+// Maximal length of formatted event without line number prefix
+#define LOG_TEXT_MAX (16 + LOG_NOT_ENOUGH_MAX)
+
+// Maximal length of formatted line number prefix ("4294967295: ")
+#define LOG_PREFIX_MAX 12
+
+// Binary log header
+struct log_header {
+    char magic[8];              // LOG_MAGIC
+    uint32_t record_size;       // Size of one record
+    uint32_t kind_count;        // Number of atom types
+    uint64_t records;           // Number of records following the header
+    char kinds[LOG_MAX_KINDS];  // Atom type letters in recipe order ("OH" for H2O)
+};
+
+// One binary log record (record N holds line N + 1)
+struct log_record {
+    uint32_t line;       // Line number (0 if the record was never written)
+    uint8_t kind;        // Atom type letter ('O' or 'H' for H2O)
+    uint8_t event;       // Event (log_event_t)
+    uint16_t reserved;   // Always 0
+    uint32_t id;         // Atom id
+    uint32_t molecule;   // Molecule id (creating and created events)
+    uint64_t timestamp;  // Monotonic time in nanoseconds
+};
+
+// Literal fragments of event text following "K id: "
+struct log_fragment {
+    const char* head;     // Text before molecule id
+    uint8_t head_length;  // Length of head
+    bool molecule;        // Molecule id and tail follow
+    const char* tail;     // Text after molecule id
+    uint8_t tail_length;  // Length of tail
+};
+
+#define LOG_FRAGMENT(text) text, sizeof(text) - 1
+
+static const struct log_fragment log_fragments[EVENT_COUNT] = {
+    [EVENT_STARTED] = {LOG_FRAGMENT("started"), false, LOG_FRAGMENT("")},
+    [EVENT_QUEUE] = {LOG_FRAGMENT("going to queue"), false, LOG_FRAGMENT("")},
+    [EVENT_CREATING] = {LOG_FRAGMENT("creating molecule "), true, LOG_FRAGMENT("")},
+    [EVENT_CREATED] = {LOG_FRAGMENT("molecule "), true, LOG_FRAGMENT(" created")},
+    [EVENT_NOT_ENOUGH] = {LOG_FRAGMENT(""), false, LOG_FRAGMENT("")},
+};
+
+// Decimal digits of 0 to 99
+static const char log_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+/**
+ * @brief Write decimal number
+ *
+ * Two digits are produced per division, buffer is not NUL terminated.
+ *
+ * @param buffer Output buffer (at least 10 bytes)
+ * @param value Number
+ * @return Number of written bytes
+ */
+static inline size_t log_format_uint(char* buffer, uint32_t value) {
+    char digits[10];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    while (value >= 100) {
+        start -= 2;
+        memcpy(start, log_digit_pairs + value % 100 * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, log_digit_pairs + value * 2, 2);
+    } else {
+        *--start = '0' + value;
+    }
+    memcpy(buffer, start, end - start);
+    return end - start;
+}
+
+/**
+ * @brief Write line number prefix ("N: ")
+ *
+ * @param buffer Output buffer (at least LOG_PREFIX_MAX bytes)
+ * @param line Line number
+ * @return Number of written bytes
+ */
+static inline size_t log_format_prefix(char* buffer, uint32_t line) {
+    size_t length = log_format_uint(buffer, line);
+    buffer[length++] = ':';
+    buffer[length++] = ' ';
+    return length;
+}
+
+/**
+ * @brief Write text of event ("K id: ...\n") without line number prefix
+ *
+ * Text is put together from literal fragments, no format string is parsed.
+ * Buffer is not NUL terminated.
+ *
+ * @param buffer Output buffer (at least LOG_TEXT_MAX bytes)
+ * @param kind Atom type letter
+ * @param id Atom id
+ * @param event Event (lower than EVENT_COUNT)
+ * @param molecule Molecule id (creating and created events)
+ * @param not_enough Text of "not enough" event of this atom type
+ * @return Number of written bytes
+ */
+static inline size_t log_format_event(char* buffer, char kind, uint32_t id, log_event_t event,
+                                      uint32_t molecule, const char* not_enough) {
+    const struct log_fragment* fragment = &log_fragments[event];
+    char* end = buffer;
+    *end++ = kind;
+    *end++ = ' ';
+    end += log_format_prefix(end, id);
+    if (event == EVENT_NOT_ENOUGH) {
+        size_t length = strlen(not_enough);
+        memcpy(end, not_enough, length);
+        end += length;
+    } else {
+        memcpy(end, fragment->head, fragment->head_length);
+        end += fragment->head_length;
+    }
+    if (fragment->molecule) {
+        end += log_format_uint(end, molecule);
+        memcpy(end, fragment->tail, fragment->tail_length);
+        end += fragment->tail_length;
+    }
+    *end++ = '\n';
+    return end - buffer;
+}
+
+/**
+ * @brief Build text of "not enough" event of recipe atom type
+ *
+ * First type (the one building molecules) is missing any of the other types
+ * (itself for single type recipe), other types may miss any type, for H2O it
+ * gives "not enough H" and "not enough O or H".
+ *
+ * @param buffer Output buffer (LOG_NOT_ENOUGH_MAX bytes)
+ * @param kinds Atom type letters
+ * @param count Number of atom types
+ * @param type Index of atom type
+ * @return Text (buffer)
+ */
+static inline const char* log_not_enough_text(char* buffer, const char* kinds, uint32_t count,
+                                              uint32_t type) {
+    const char* separator = " ";
+    memcpy(buffer, "not enough", 10);
+    size_t length = 10;
+    for (uint32_t i = 0; i < count; i++) {
+        if (type == 0 && i == 0 && count > 1) {
+            continue;
+        }
+        size_t separator_length = strlen(separator);
+        memcpy(buffer + length, separator, separator_length);
+        length += separator_length;
+        buffer[length++] = kinds[i];
+        separator = " or ";
+    }
+    buffer[length] = '\0';
+    return buffer;
+}
+
+#endif
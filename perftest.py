@@ -0,0 +1,332 @@
+#!/usr/bin/python3
+"""Scalability tests of proj2.
+
+Runs proj2 with TI=TB=0 at NO from 10 up to 10^6 (NH = 2 * NO) on every
+engine, validates proj2.out in a single pass and compares wall time, peak
+RSS and number of spawned tasks with stored baselines (a run without
+baseline fails unless --update is given). A few fixed runs of
+generic recipes on every log backend check that no line is cut or merged.
+
+Usage: perftest.py [--update] [--max=N] [--engine=E] [--baseline=FILE] [--proj2=PATH]
+"""
+
+import json
+import os
+import re
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# Engines and the largest NO each of them is run with (fork and threads
+# engines keep every atom alive, 10^4 would need 30000 tasks)
+ENGINES = {"fork": 1000, "threads": 1000, "pool": 10**6}
+
+# NO of the runs (NH is always twice as many)
+SIZES = [10, 100, 1000, 10**4, 10**5, 10**6]
+
+# Allowed regression: value may grow by the ratio plus the absolute slack
+TOLERANCE = {
+    "wall_s": (0.5, 0.05),
+    "rss_kb": (0.25, 1024),
+    "tasks": (0.1, 16),
+}
+
+# Seconds a single run may take
+TIMEOUT = 600
+
+# Recipe runs (recipe, atom counts of every type) on every text log backend,
+# the 8 type recipe has the longest "not enough" lines
+RECIPE_RUNS = [
+    ("A1B1C1D1E1F1G1H1", [2, 2, 2, 2, 2, 2, 2, 1]),
+    ("C1O2", [30, 50]),
+]
+RECIPE_LOGS = ["stdio", "ring", "mmap"]
+
+# One line of recipe run
+RECIPE_LINE = re.compile(r"(\d+): ([A-Z]) (\d+): (started|going to queue|creating molecule \d+|"
+                         r"molecule \d+ created|not enough [A-Z](?: or [A-Z])*)\n")
+
+
+def check_output(path, no, nh):
+    """Validate proj2.out in one pass (linear in the number of lines).
+
+    Every atom must go through started, going to queue and either creating
+    and created of one molecule or not enough. Molecules are numbered 1 to
+    min(NO, NH / 2) in the order they are created, each of one O and two H.
+    All three atoms of a molecule are creating before any of them is
+    created, the next molecule starts once all three are created and "not
+    enough" comes only after all molecules started.
+
+    Returns None if valid, error message otherwise.
+    """
+    total = min(no, nh // 2)
+    states = {"O": bytearray(no + 1), "H": bytearray(nh + 1)}
+    limits = {"O": no, "H": nh}
+    not_enough = {"O": "not enough H", "H": "not enough O or H"}
+    molecule = 0      # Molecule being created
+    creating = 0      # Its atoms which are creating it
+    created = 0       # Its atoms which have created it
+    oxygens = 0       # Its oxygens
+    started = 0       # Atoms of all molecules which were creating
+    finished = 0      # Atoms which ended their life
+    expected = 1
+
+    with open(path, "rb") as file:
+        for raw in file:
+            line = raw.decode("ascii", "replace").rstrip("\n")
+            parts = line.split(": ", 2)
+            if len(parts) != 3 or parts[0] != str(expected):
+                return "line %d: bad format or number: %r" % (expected, line)
+            expected += 1
+            atom = parts[1].split(" ")
+            if len(atom) != 2 or atom[0] not in states or not atom[1].isdigit():
+                return "line %s: bad atom: %r" % (parts[0], line)
+            kind, id = atom[0], int(atom[1])
+            if id < 1 or id > limits[kind]:
+                return "line %s: atom id out of range: %r" % (parts[0], line)
+            state = states[kind]
+            text = parts[2]
+
+            if text == "started":
+                if state[id] != 0:
+                    return "line %s: started twice: %r" % (parts[0], line)
+                state[id] = 1
+            elif text == "going to queue":
+                if state[id] != 1:
+                    return "line %s: queue before start: %r" % (parts[0], line)
+                state[id] = 2
+            elif text.startswith("creating molecule "):
+                number = int(text[18:]) if text[18:].isdigit() else -1
+                if state[id] != 2:
+                    return "line %s: creating out of queue: %r" % (parts[0], line)
+                if creating == 0 and created == 0 and number == molecule + 1:
+                    molecule = number
+                if number != molecule or creating == 3 or creating < created:
+                    return "line %s: molecule out of order: %r" % (parts[0], line)
+                creating += 1
+                oxygens += kind == "O"
+                started += 1
+                state[id] = 3
+            elif text.startswith("molecule ") and text.endswith(" created"):
+                number = int(text[9:-8]) if text[9:-8].isdigit() else -1
+                if state[id] != 3 or number != molecule or creating != 3:
+                    return "line %s: created too early: %r" % (parts[0], line)
+                if oxygens != 1:
+                    return "line %s: molecule of %d oxygens: %r" % (parts[0], oxygens, line)
+                created += 1
+                if created == 3:
+                    creating = created = oxygens = 0
+                state[id] = 4
+                finished += 1
+            elif text == not_enough[kind]:
+                if state[id] != 2 or started != 3 * total:
+                    return "line %s: not enough too early: %r" % (parts[0], line)
+                state[id] = 4
+                finished += 1
+            else:
+                return "line %s: unknown line: %r" % (parts[0], line)
+
+    if molecule != total or creating != 0:
+        return "%d of %d molecules created" % (molecule, total)
+    if finished != no + nh:
+        return "%d of %d atoms finished" % (finished, no + nh)
+    return None
+
+
+def check_recipe_output(path, recipe, counts):
+    """Validate line format and numbering of recipe run and its number of lines.
+
+    Every atom logs started and going to queue, then creating and created
+    of a molecule or not enough.
+
+    Returns None if valid, error message otherwise.
+    """
+    needed = [int(n) for n in re.findall(r"\d+", recipe)]
+    molecules = min(count // need for count, need in zip(counts, needed))
+    expected = 3 * sum(counts) + molecules * sum(needed)
+    number = 0
+    with open(path, "rb") as file:
+        for raw in file:
+            number += 1
+            line = raw.decode("ascii", "replace")
+            match = RECIPE_LINE.fullmatch(line)
+            if match is None or int(match.group(1)) != number:
+                return "line %d: bad format or number: %r" % (number, line)
+    if number != expected:
+        return "%d of %d lines" % (number, expected)
+    return None
+
+
+def run_recipe(proj2, recipe, counts, log):
+    """Run proj2 with recipe in a scratch directory.
+
+    Returns error message (None if successful).
+    """
+    directory = tempfile.mkdtemp(prefix="proj2-perftest-")
+    command = [proj2, "--log=" + log, "--recipe=" + recipe] + [str(n) for n in counts] + ["0", "0"]
+    try:
+        try:
+            process = subprocess.run(command, cwd=directory, stdout=subprocess.DEVNULL,
+                                     stderr=subprocess.PIPE, timeout=TIMEOUT)
+        except subprocess.TimeoutExpired:
+            return "timeout after %d s" % TIMEOUT
+        if process.returncode != 0:
+            return "exit status %d: %s" % (process.returncode,
+                                           process.stderr.decode(errors="replace").strip())
+        return check_recipe_output(os.path.join(directory, "proj2.out"), recipe, counts)
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+def forks():
+    """Get number of tasks (processes and threads) created since boot."""
+    with open("/proc/stat") as file:
+        for line in file:
+            if line.startswith("processes "):
+                return int(line.split()[1])
+    return 0
+
+
+def task_limit():
+    """Get number of tasks a run may have alive at once."""
+    limit = resource.getrlimit(resource.RLIMIT_NPROC)[0]
+    limits = [limit if limit != resource.RLIM_INFINITY else 2**31]
+    for path in ("/proc/sys/kernel/threads-max", "/proc/sys/kernel/pid_max"):
+        try:
+            with open(path) as file:
+                limits.append(int(file.read()))
+        except OSError:
+            pass
+    return min(limits)
+
+
+def run(proj2, engine, no, nh):
+    """Run proj2 in a scratch directory.
+
+    Peak RSS is taken from the --rusage report of proj2. Kernel carries peak
+    RSS of a process over exec(), so proj2 is forked by a shell instead of
+    this (much larger) interpreter.
+
+    Returns dict of measurements and error message (None if successful).
+    """
+    directory = tempfile.mkdtemp(prefix="proj2-perftest-")
+    command = ["/bin/sh", "-c", '"$@"; exit $?', "sh", proj2, "--rusage", "--engine=" + engine,
+               str(no), str(nh), "0", "0"]
+    try:
+        before = forks()
+        start = time.monotonic()
+        try:
+            process = subprocess.run(command, cwd=directory, stdout=subprocess.DEVNULL,
+                                     stderr=subprocess.PIPE, timeout=TIMEOUT)
+        except subprocess.TimeoutExpired:
+            return None, "timeout after %d s" % TIMEOUT
+        wall = time.monotonic() - start
+        tasks = forks() - before
+        report = process.stderr.decode(errors="replace")
+        if process.returncode != 0:
+            return None, "exit status %d: %s" % (process.returncode, report.strip())
+
+        rss = [int(line.split()[2]) for line in report.splitlines()
+               if line.strip().startswith("max rss:")]
+        if not rss:
+            return None, "no resource usage report"
+        error = check_output(os.path.join(directory, "proj2.out"), no, nh)
+        if error is not None:
+            return None, error
+        return {"wall_s": round(wall, 4), "rss_kb": max(rss), "tasks": tasks}, None
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+def regressions(result, baseline):
+    """Get list of measurements which regressed against baseline."""
+    failed = []
+    for key, (ratio, slack) in TOLERANCE.items():
+        if key in baseline and result[key] > baseline[key] * (1 + ratio) + slack:
+            failed.append("%s %s > baseline %s" % (key, result[key], baseline[key]))
+    return failed
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    proj2 = os.path.join(here, "proj2")
+    baseline_path = os.path.join(here, "perftest-baseline.json")
+    update = False
+    largest = max(SIZES)
+    engines = list(ENGINES)
+    for arg in sys.argv[1:]:
+        if arg == "--update":
+            update = True
+        elif arg.startswith("--max="):
+            largest = int(arg[6:])
+        elif arg.startswith("--engine="):
+            engines = arg[9:].split(",")
+        elif arg.startswith("--baseline="):
+            baseline_path = arg[11:]
+        elif arg.startswith("--proj2="):
+            proj2 = os.path.abspath(arg[8:])
+        else:
+            print(__doc__.strip().splitlines()[-1])
+            return 2
+
+    baselines = {}
+    if os.path.exists(baseline_path):
+        with open(baseline_path) as file:
+            baselines = json.load(file)
+
+    limit = task_limit()
+    failed = 0
+    for recipe, counts in RECIPE_RUNS:
+        for log in RECIPE_LOGS:
+            name = "%s %s" % (recipe, log)
+            error = run_recipe(proj2, recipe, counts, log)
+            print("[%s] %-24s %s" % ("FAIL" if error else " OK ", name, error or "recipe"))
+            failed += error is not None
+
+    for engine in engines:
+        for no in SIZES:
+            nh = 2 * no
+            name = "%s %d %d" % (engine, no, nh)
+            if no > min(largest, ENGINES.get(engine, 0)):
+                continue
+            # Fork and threads engines keep every atom alive until its molecule is done
+            if engine != "pool" and no + nh + 64 > limit:
+                print("[SKIP] %-24s %d tasks over limit %d" % (name, no + nh, limit))
+                continue
+
+            result, error = run(proj2, engine, no, nh)
+            if error is not None:
+                print("[FAIL] %-24s %s" % (name, error))
+                failed += 1
+                continue
+
+            measured = "%.3f s, %d kB, %d tasks" % (result["wall_s"], result["rss_kb"],
+                                                  result["tasks"])
+            problems = []
+            if not update and name not in baselines:
+                problems = ["no baseline (record it with --update)"]
+            elif not update:
+                problems = regressions(result, baselines[name])
+            if problems:
+                print("[FAIL] %-24s %s: %s" % (name, measured, "; ".join(problems)))
+                failed += 1
+            else:
+                print("[ OK ] %-24s %s" % (name, measured))
+            if update:
+                baselines[name] = result
+
+    if update:
+        with open(baseline_path, "w") as file:
+            json.dump(baselines, file, indent=2, sort_keys=True)
+            file.write("\n")
+        print("Baselines written to %s" % baseline_path)
+
+    print("%d failed" % failed)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
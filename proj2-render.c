@@ -0,0 +1,98 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * @brief Render binary log as text
+ *
+ * Output is the same as proj2 writes to proj2.out with text log.
+ *
+ * @param header Mapped binary log
+ * @param size Size of mapping
+ * @param output Output stream
+ * @return 0 if successful, 1 otherwise
+ */
+int render(struct log_header* header, size_t size, FILE* output) {
+    if (size < sizeof(struct log_header) || memcmp(header->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) ||
+        header->record_size != sizeof(struct log_record) || header->kind_count == 0 ||
+        header->kind_count > LOG_MAX_KINDS ||
+        header->records > (size - sizeof(struct log_header)) / sizeof(struct log_record)) {
+        fprintf(stderr, "Invalid binary log\n");
+        return 1;
+    }
+
+    // Not enough lines depend on recipe
+    char not_enough[LOG_MAX_KINDS][LOG_NOT_ENOUGH_MAX];
+    for (uint32_t i = 0; i < header->kind_count; i++) {
+        log_not_enough_text(not_enough[i], header->kinds, header->kind_count, i);
+    }
+
+    struct log_record* records = (struct log_record*)(header + 1);
+    for (uint64_t i = 0; i < header->records; i++) {
+        struct log_record* record = &records[i];
+        const char* kind = memchr(header->kinds, record->kind, header->kind_count);
+        if (record->line != i + 1 || kind == NULL || record->event >= EVENT_COUNT) {
+            fprintf(stderr, "Invalid record of line %llu\n", (unsigned long long)i + 1);
+            return 1;
+        }
+        char line[LOG_PREFIX_MAX + LOG_TEXT_MAX];
+        size_t length = log_format_prefix(line, record->line);
+        length += log_format_event(line + length, record->kind, record->id, record->event,
+                                   record->molecule, not_enough[kind - header->kinds]);
+        fwrite(line, 1, length, output);
+    }
+    return 0;
+}
+
+/**
+ * Main process
+ *
+ * Usage: proj2-render [BINARY_LOG [OUTPUT]], defaults are proj2.bin and proj2.out
+ */
+int main(int argc, char* argv[]) {
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [BINARY_LOG [OUTPUT]]\n", argv[0]);
+        return 1;
+    }
+    const char* input_name = argc > 1 ? argv[1] : LOG_BINARY_FILE;
+    const char* output_name = argc > 2 ? argv[2] : "proj2.out";
+
+    int fd = open(input_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Could not open %s\n", input_name);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "Invalid binary log\n");
+        close(fd);
+        return 1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", input_name);
+        return 1;
+    }
+
+    FILE* output = fopen(output_name, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Could not open %s\n", output_name);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    int result = render(map, st.st_size, output);
+    if (fclose(output) != 0 && result == 0) {
+        fprintf(stderr, "Could not write %s\n", output_name);
+        result = 1;
+    }
+    munmap(map, st.st_size);
+    return result;
+}
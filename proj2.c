@@ -1,476 +1,5090 @@
+// CPU affinity (cpu_set_t) is a GNU extension
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "log.h"
+#include "sync.h"
+
+// Size of cache line
+#define CACHE_LINE_SIZE 64
+
+// Fields written by different roles are placed on separate cache lines (the
+// gain is unmeasured, there are no multi-core results of make bench-layout yet),
+// SHARED_PACKED builds the old packed layout (for comparison benchmarks)
+#ifdef SHARED_PACKED
+#define CACHE_ALIGNED
+#define SHARED_LAYOUT "packed"
+#else
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#define SHARED_LAYOUT "aligned"
+#endif
+
+// PROJ2_ENGINE and PROJ2_LOG (ENGINE= and LOG= of make) fix engine and log
+// backend at build time, so branches on them fold to constants
+#ifdef PROJ2_ENGINE
+#define ENGINE(args) ((engine_t)PROJ2_ENGINE)
+#define ENGINE_DEFAULT PROJ2_ENGINE
+#else
+#define ENGINE(args) ((args).engine)
+#define ENGINE_DEFAULT ENGINE_FORK
+#endif
+#ifdef PROJ2_LOG
+#define LOG_DEFAULT PROJ2_LOG
+#else
+#define LOG_DEFAULT LOG_STDIO
+#endif
+
 // All semaphores
 typedef enum {
-    SEM_MUTEX,            // General mutex
-    SEM_LOG_MUTEX,        // Log mutex
-    SEM_TURNSTILE_MUTEX,  // Turnstile mutex (for barrier)
-    SEM_MOLECULE_MUTEX,   // Mutex for writing molecule counts
-    SEM_OXYGEN_QUEUE,     // Oxygen queue
-    SEM_HYDROGEN_QUEUE,   // Hydrogen queue
-    SEM_TURNSTILE,        // First turnstile (for barrier)
-    SEM_TURNSTILE2,       // Second turnstile (for barrier)
-    SEM_COUNT             // NOT FOR REAL USE! Just a count of all semaphores
+    SEM_MUTEX,           // General mutex
+    SEM_OXYGEN_QUEUE,    // Oxygen queue
+    SEM_HYDROGEN_QUEUE,  // Hydrogen queue
+    SEM_COUNT            // NOT FOR REAL USE! Just a count of all semaphores
 } Sem;
 
-// Shared memory structure
+// Log backends
+typedef enum {
+    LOG_STDIO,   // Single write() of the whole line under log mutex (default)
+    LOG_RING,    // Lock-free shared ring buffer flushed by a single drainer
+    LOG_BINARY,  // Fixed size event records in memory mapped file (rendered by proj2-render)
+    LOG_MMAP,    // Lines copied straight into memory mapped proj2.out
+} log_backend_t;
+
+// Log backend names (for benchmark results)
+const char* log_backend_names[] = {[LOG_STDIO] = "stdio", [LOG_RING] = "ring",
+                                   [LOG_BINARY] = "binary", [LOG_MMAP] = "mmap"};
+
+// Number of lines in log ring buffer (power of two, scaled with number of atoms)
+#define LOG_RING_MIN_SLOTS 1024
+#define LOG_RING_MAX_SLOTS 65536
+
+// One line in log ring buffer (two cache lines, the longest line of any recipe fits)
+struct log_slot {
+    uint32_t line;                                          // Line number in slot (0 if unused)
+    uint32_t length;                                        // Length of text
+    char text[2 * CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];  // Formatted line with line number
+};
+
+__extension__ _Static_assert(sizeof(((struct log_slot*)0)->text) >= LOG_PREFIX_MAX + LOG_TEXT_MAX,
+                             "longest log line must fit into ring log slot");
+
+// Mapped log position packs number of written lines (low bits) and byte offset (high bits)
+#define LOG_MMAP_LINE_BITS 28
+#define LOG_MMAP_LINE_MASK ((UINT64_C(1) << LOG_MMAP_LINE_BITS) - 1)
+
+// Upper bound of one line length (mapped log is sized by it)
+#define LOG_MMAP_LINE_SIZE 64
+
+// Number of positions in molecule id handoff queue
+#define HANDOFF_SLOTS 1024
+
+// Bounded MPMC queue handing molecule ids to woken atoms (parallel molecules)
+struct handoff {
+    uint32_t head CACHE_ALIGNED;                     // Next position to pop
+    uint32_t tail CACHE_ALIGNED;                     // Next position to push
+    uint32_t sequence[HANDOFF_SLOTS] CACHE_ALIGNED;  // Position the slot is ready for
+    uint32_t molecule[HANDOFF_SLOTS];                // Molecule ids
+};
+
+// Number of molecules that can be created at once (parallel molecules)
+#define MOLECULE_SLOTS 256
+
+// Synchronization of one molecule being created (parallel molecules)
+struct molecule_slot {
+    uint32_t owner;          // Molecule currently allowed to use this slot
+    uint32_t left;           // Number of atoms done with this slot
+    sync_barrier_t barrier;  // Molecule barrier
+} CACHE_ALIGNED;
+
+// Semaphore on its own cache line
+struct padded_sem {
+    sync_sem_t sem;  // Semaphore
+} CACHE_ALIGNED;
+
+// Maximal number of atom types in recipe and of atoms in one molecule
+#define RECIPE_MAX_TYPES LOG_MAX_KINDS
+#define RECIPE_MAX_PARTIES 64
+
+// Molecule recipe (atom types and their counts in one molecule)
+typedef struct recipe {
+    bool generic;                           // Recipe is not H2O (generic matcher is used)
+    uint32_t types;                         // Number of atom types
+    char kinds[RECIPE_MAX_TYPES];           // Type letters, atoms of the first type build molecules
+    uint32_t needed[RECIPE_MAX_TYPES];      // Atoms of every type in one molecule
+    uint32_t atoms[RECIPE_MAX_TYPES];       // Number of atoms of every type (command line)
+    uint32_t parties;                       // Number of atoms in one molecule
+    char not_enough[RECIPE_MAX_TYPES][LOG_NOT_ENOUGH_MAX];  // "not enough" texts of every type
+} recipe_t;
+
+// Molecule recipe (H2O by default)
+recipe_t recipe = {
+    .types = 2,
+    .kinds = "OH",
+    .needed = {1, 2},
+    .parties = 3,
+    .not_enough = {"not enough H", "not enough O or H"},
+};
+
+// Exit statuses and resource usage of reaped children
+struct reap_stats {
+    uint64_t reaped;        // Number of reaped children
+    uint64_t failed;        // Children exited with nonzero status
+    uint64_t signaled;      // Children terminated by signal
+    uint64_t user_us;       // User CPU time in microseconds
+    uint64_t system_us;     // System CPU time in microseconds
+    uint64_t max_rss_kb;    // Largest maximum resident set size of one child
+    uint64_t voluntary;     // Voluntary context switches
+    uint64_t involuntary;   // Involuntary context switches
+    uint64_t minor_faults;  // Page faults served without I/O
+    uint64_t major_faults;  // Page faults that required I/O
+};
+
+// Molecule ids taken from global counter at once (sharded reactors)
+#define REACTOR_ID_BATCH 16
+
+// Bonding reactor, atoms of one reactor bond only with each other
+struct reactor {
+    // Bonding queue (written on every arrival)
+    uint32_t oxygen_count CACHE_ALIGNED;  // New molecule synchronization
+    uint32_t hydrogen_count;              // New molecule synchronization
+    uint32_t hydrogen_arrived;            // Hydrogens assigned here so far (work stealing)
+    uint32_t spin_budget[SEM_COUNT];      // Adaptive spin budget of every queue
+
+    // Molecule counters (written once per molecule)
+    uint32_t molecule_count CACHE_ALIGNED;  // Molecules created by this reactor
+    uint32_t molecule_id;                   // Id of molecule being created (for logging)
+    uint32_t batch_next;                    // Next id of batch taken from global counter
+    uint32_t batch_left;                    // Ids left in batch
+    bool not_enough;                        // Flag to indicate if we have enough molecules
+    sync_mutex_t molecule_mutex;            // Mutex for writing molecule counts
+
+    // Group state (written by atoms of the molecule being created)
+    sync_group_t group CACHE_ALIGNED;  // Phases of the molecule being created
+
+    // All semaphores
+    struct padded_sem semaphores[SEM_COUNT];
+
+    // Assigned atoms (read only after initialization)
+    uint32_t oxygens CACHE_ALIGNED;  // Oxygens bonding here
+    uint32_t hydrogens;              // Hydrogens bonding here (stolen ones included)
+    uint32_t molecules;              // Number of molecules this reactor creates
+    uint32_t hydrogen_keep;          // Own hydrogens which stay, later arrivals are stolen
+    uint32_t* hydrogen_steals;       // Number of own hydrogens stolen by every reactor
+};
+
+// Shared memory structure (grouped by cache lines written by the same role)
 struct s_shared {
-    uint32_t oxygen_count;        // New molecule synchronization
-    uint32_t hydrogen_count;      // New molecule synchronization
-    uint32_t molecule_count;      // Total molecule count (for logging)
-    uint32_t oxygen_processed;    // Total oxygen processed (for determining if we have enough)
-    uint32_t hydrogen_processed;  // Total hydrogen processed (for determining if we have enough)
-    uint32_t turnstile_count;     // Turnstile synchronization (for barrier)
-    bool not_enough;              // Flag to indicate if we have enough molecules
-    uint32_t log_line_number;     // Current line number in log file
-    sem_t semaphores[SEM_COUNT];  // All semaphores
-    FILE* log_stream;             // Log file stream
+    // Bonding queue of parallel molecules (written on every arrival)
+    uint64_t waiting CACHE_ALIGNED;  // Waiting O (high half) and H (parallel molecules)
+
+    // Global molecule counters (written once per molecule)
+    uint32_t molecules_done CACHE_ALIGNED;  // Number of finished molecules (parallel molecules)
+    uint32_t molecule_next;                 // Last global molecule id given out (reactors)
+    uint32_t molecules_timed;               // Number of recorded molecule durations (benchmark)
+    uint32_t atoms_ended;                   // Atoms which finished their work (benchmark)
+    uint64_t atoms_ended_at;                // Time the last atom finished its work (benchmark)
+
+    // Logger state (written on every line)
+    uint32_t log_line_number CACHE_ALIGNED;  // Current line number in log file
+    uint64_t log_position;                   // Written lines and end offset (mapped log)
+    sync_mutex_t log_mutex;                  // Log mutex
+    int log_fd;                              // Log file descriptor
+    struct log_header* log_header;           // Mapped binary log (binary log)
+    uint64_t log_records;                    // Capacity of binary log in records (binary log)
+    char* log_map;                           // Mapped proj2.out (mapped log)
+    size_t log_map_size;                     // Size of mapping (mapped log)
+
+    // Log drainer state (written by drainer only)
+    uint32_t log_drained CACHE_ALIGNED;  // Next line number to be written by drainer (ring log)
+
+    // Variable sized parts of the segment (read only after initialization)
+    struct log_slot* log_ring CACHE_ALIGNED;  // Ring log lines (ring log)
+    uint32_t log_ring_slots;                  // Number of ring log lines (power of two)
+    struct reactor* reactors;                 // Bonding reactors
+    uint32_t reactor_count;                   // Number of bonding reactors
+    sync_sem_t* replay_gates;                 // Turn and arrivals of every molecule (replay)
+    sync_sem_t* replay_bonds;                 // Release of hydrogens of every molecule (replay)
+
+    // Recipe matcher (generic recipes, protected by SEM_MUTEX and molecule mutex)
+    uint32_t recipe_waiting[RECIPE_MAX_TYPES] CACHE_ALIGNED;  // Atoms of every type in queue
+    bool recipe_built;                                        // Builder of molecule was elected
+    struct padded_sem recipe_queues[RECIPE_MAX_TYPES];        // Bonding queue of every type
+
+    // Reaped children (written once per reaped batch)
+    struct reap_stats atoms_reaped CACHE_ALIGNED;  // Atom processes (fork engine)
+    struct reap_stats spawners_reaped;             // Spawner processes (fork engine)
+    sync_mutex_t reaped_mutex;                     // Mutex for merging spawner statistics
+
+    // Molecule ids for woken atoms (parallel molecules)
+    struct handoff oxygen_handoff CACHE_ALIGNED;
+    struct handoff hydrogen_handoff;
+
+    // Molecules being created (parallel molecules)
+    struct molecule_slot molecule_slots[MOLECULE_SLOTS];
 };
 
+#ifndef SHARED_PACKED
+// Check that every group starts its own cache line
+#define ASSERT_STRUCT_CACHE_LINE(type, field)                                      \
+    __extension__ _Static_assert(offsetof(type, field) % CACHE_LINE_SIZE == 0, \
+                                 #field " is not aligned to cache line")
+#define ASSERT_CACHE_LINE(field) ASSERT_STRUCT_CACHE_LINE(struct s_shared, field)
+ASSERT_STRUCT_CACHE_LINE(struct reactor, oxygen_count);
+ASSERT_STRUCT_CACHE_LINE(struct reactor, molecule_count);
+ASSERT_STRUCT_CACHE_LINE(struct reactor, group);
+ASSERT_STRUCT_CACHE_LINE(struct reactor, semaphores);
+ASSERT_STRUCT_CACHE_LINE(struct reactor, oxygens);
+ASSERT_CACHE_LINE(waiting);
+ASSERT_CACHE_LINE(molecules_done);
+ASSERT_CACHE_LINE(log_line_number);
+ASSERT_CACHE_LINE(log_drained);
+ASSERT_CACHE_LINE(recipe_waiting);
+ASSERT_CACHE_LINE(atoms_reaped);
+ASSERT_CACHE_LINE(log_ring);
+ASSERT_CACHE_LINE(oxygen_handoff);
+__extension__ _Static_assert(sizeof(struct log_slot) == 2 * CACHE_LINE_SIZE,
+                             "log slot must fill exactly two cache lines");
+__extension__ _Static_assert(sizeof(struct padded_sem) == CACHE_LINE_SIZE,
+                             "semaphore must fill exactly one cache line");
+#endif
+
+// Execution engines (how atoms are run)
+typedef enum {
+    ENGINE_FORK,     // One process per atom (default)
+    ENGINE_THREADS,  // One thread per atom in a single address space
+    ENGINE_POOL,     // Fixed number of worker threads multiplexing all atoms
+} engine_t;
+
+// Engine names (for benchmark results)
+const char* engine_names[] = {[ENGINE_FORK] = "fork", [ENGINE_THREADS] = "threads",
+                              [ENGINE_POOL] = "pool"};
+
 // Command line arguments structure
 typedef struct arguments {
-    uint32_t no;  // Number of oxygen molecules
-    uint32_t nh;  // Number of hydrogen molecules
-    uint32_t ti;  // Maximal molecule initalization time
-    uint32_t tb;  // Maximal molecule build time
+    uint32_t no;        // Number of oxygen molecules
+    uint32_t nh;        // Number of hydrogen molecules
+    uint32_t ti;        // Maximal molecule initalization time
+    uint32_t tb;        // Maximal molecule build time
+    engine_t engine;    // Execution engine
+    uint32_t workers;   // Number of worker threads (pool engine)
+    uint32_t spawners;  // Number of spawner processes (fork engine, 0 forks from parent)
+    bool crash_flush;   // Flush log on fatal signals (ring log)
+    bool parallel;      // Allow more molecules to be created at once
+    uint64_t seed;      // Base seed of all random generators
+    bool seeded;        // Seed was given on command line
+    bool rusage;        // Print summary of exit statuses and resource usage
 } arguments_t;
 
+// Per-atom pseudo random generator (xorshift64*)
+typedef struct rng {
+    uint64_t state;  // Generator state (never 0)
+} rng_t;
+
+// Batch reaper of child processes
+typedef struct reaper {
+    int fd;             // signalfd reading SIGCHLD (-1 falls back to blocking wait4)
+    sigset_t old_mask;  // Signal mask before SIGCHLD was blocked
+} reaper_t;
+
+// Thread engine atom description
+typedef struct atom_thread {
+    pthread_t thread;   // Thread handle
+    uint64_t index;     // Atom index (oxygens first, then hydrogens)
+    arguments_t* args;  // Parsed command line arguments
+} atom_thread_t;
+
+// Stack size of one atom thread (atoms don't need much)
+#define ATOM_THREAD_STACK_SIZE (64 * 1024)
+
+// Pool engine atom states (same states as the log defines)
+typedef enum {
+    ATOM_START,       // Log "started" and sleep before going to queue
+    ATOM_QUEUE,       // Log "going to queue" and enter bonding queue
+    ATOM_WAITING,     // Waiting in bonding queue (not runnable)
+    ATOM_CREATING,    // Log "creating molecule"
+    ATOM_BUILDING,    // Waiting for molecule to be built (not runnable)
+    ATOM_CREATED,     // Log "molecule created"
+    ATOM_NOT_ENOUGH,  // Log "not enough"
+    ATOM_DONE,        // Finished
+} atom_state_t;
+
+// Pool engine atom
+typedef struct pool_atom {
+    rng_t rng;      // Random generator of this atom
+    uint32_t id;    // Atom id
+    bool oxygen;    // true for oxygen, false for hydrogen
+    uint8_t state;  // Current state (atom_state_t)
+} pool_atom_t;
+
+// FIFO queue of atom indexes (fixed capacity)
+typedef struct atom_queue {
+    uint32_t* items;    // Ring buffer
+    uint32_t capacity;  // Ring buffer capacity
+    uint32_t head;      // Index of first item
+    uint32_t count;     // Number of items
+} atom_queue_t;
+
+// Sleeping atom (min-heap item)
+typedef struct pool_timer {
+    uint64_t deadline;  // Monotonic time of wakeup in nanoseconds
+    uint32_t atom;      // Atom index
+} pool_timer_t;
+
+// Pool engine state, everything is protected by mutex
+typedef struct pool {
+    pthread_mutex_t mutex;          // Pool mutex
+    pthread_cond_t cond;            // Signalled when some atom becomes runnable
+    arguments_t* args;              // Parsed command line arguments
+    pool_atom_t* atoms;             // All atoms (oxygens first, then hydrogens)
+    uint32_t atom_count;            // Total number of atoms
+    uint32_t done_count;            // Number of finished atoms
+    atom_queue_t ready;             // Runnable atoms
+    atom_queue_t oxygen_waiting;    // Oxygens in bonding queue
+    atom_queue_t hydrogen_waiting;  // Hydrogens in bonding queue
+    pool_timer_t* timers;           // Sleeping atoms (min-heap by deadline)
+    uint32_t timer_count;           // Number of sleeping atoms
+    bool molecule_active;           // Molecule is being created
+    uint32_t molecule_atoms[3];     // Atoms of active molecule (oxygen first)
+    uint32_t molecule_pending;      // Atoms of active molecule yet to finish current phase
+    uint32_t molecule_total;        // Number of molecules that can be created
+    uint64_t molecule_start;        // Time when active molecule was bonded (benchmark)
+    uint32_t worker_count;          // Number of started workers (next worker index)
+} pool_t;
+
+// Benchmark mode state
+struct bench {
+    bool enabled;              // Skip all sleeps and report timing
+    char* output;              // CSV file results are appended to (NULL for none)
+    uint64_t* molecule_times;  // Duration of every molecule in nanoseconds (shared memory)
+    size_t molecule_count;     // Number of items in molecule_times
+} bench;
+
+// Traced points of atom lifecycle
+typedef enum {
+    TRACE_STARTED,     // Atom started
+    TRACE_QUEUE,       // Atom entered bonding queue
+    TRACE_WOKEN,       // Atom left bonding queue
+    TRACE_CREATING,    // Atom started creating molecule
+    TRACE_CREATED,     // Molecule created
+    TRACE_NOT_ENOUGH,  // Atom found out there are not enough atoms
+    TRACE_EXIT,        // Atom finished
+    TRACE_COUNT        // NOT FOR REAL USE! Just a count of all points
+} trace_point_t;
+
+// Lifecycle of one atom (shared memory, written only by the atom itself)
+struct trace_atom {
+    uint64_t time[TRACE_COUNT];  // Monotonic time of every point in nanoseconds (0 if not reached)
+    uint32_t molecule;           // Molecule id (0 if none)
+    int32_t pid;                 // Process running the atom
+};
+
+// Trace export state
+struct trace {
+    char* output;              // Chrome trace JSON file (NULL if disabled)
+    struct trace_atom* atoms;  // Lifecycles of all atoms, oxygens first (shared memory)
+    uint32_t oxygen_count;     // Number of oxygens (index of first hydrogen)
+    uint64_t start;            // Time trace timestamps are relative to
+} trace;
+
+// Stream mode (atoms arrive continuously instead of NO/NH)
+struct stream {
+    bool enabled;                // Atoms are read from stdin or Unix socket, log goes to stdout
+    char* socket;                // Unix socket path (NULL reads stdin)
+    uint32_t slots;              // Number of oxygen threads (twice as many hydrogen threads)
+    uint64_t backlog;            // Arrived atoms without thread at which input reading pauses
+    volatile sig_atomic_t stop;  // SIGINT or SIGTERM was received
+} stream = {.slots = 64, .backlog = 4096};
+
+// Stream engine state (shared by reader and atom threads, protected by mutex)
+typedef struct stream_state {
+    pthread_mutex_t mutex;  // State mutex
+    pthread_cond_t launch;  // Signalled when atoms arrive or stream closes
+    pthread_cond_t change;  // Signalled when atom is launched or finished
+    uint64_t arrived[2];    // Arrived hydrogens and oxygens (indexed by oxygen flag)
+    uint64_t launched[2];   // Hydrogens and oxygens given to a thread
+    uint64_t finished;      // Finished atoms
+    uint64_t pauses;        // Times input reading paused for backpressure
+    uint64_t paused_ns;     // Total time input reading was paused
+    uint64_t paused_since;  // Start of current pause (0 while reading)
+    uint64_t invalid;       // Invalid input bytes (ignored, the run fails)
+    bool draining;          // Input ended and all molecules are done, atoms are leftovers
+    bool closed;            // All atoms finished, threads exit
+    arguments_t args;       // Parsed command line arguments
+} stream_state_t;
+
+// Stream engine atom thread (runs one atom after another)
+typedef struct stream_slot {
+    pthread_t thread;       // Thread handle
+    bool oxygen;            // Thread runs oxygens (hydrogens otherwise)
+    uint32_t index;         // Thread index (CPU placement)
+    stream_state_t* state;  // Engine state
+} stream_slot_t;
+
+// Instrumented phases of atoms (lock waits first, in the order of Sem)
+typedef enum {
+    PHASE_MUTEX,           // Waiting for SEM_MUTEX
+    PHASE_OXYGEN_QUEUE,    // Oxygen waiting in queue
+    PHASE_HYDROGEN_QUEUE,  // Hydrogen waiting in queue
+    PHASE_LOG_LOCK,        // Waiting for log mutex
+    PHASE_MOLECULE_LOCK,   // Waiting for molecule mutex
+    PHASE_GROUP_BOND,      // Molecule released for creating (followers)
+    PHASE_GROUP_BUILT,     // All atoms of molecule creating (leader), molecule built (followers)
+    PHASE_GROUP_DONE,      // All atoms of molecule created (leader)
+    PHASE_INIT,            // Initialization sleep (TI)
+    PHASE_BUILD,           // Molecule build sleep (TB)
+    PHASE_COUNT            // NOT FOR REAL USE! Just a count of all phases
+} phase_t;
+
+// Number of phases which are lock waits (contention is counted for them)
+#define PHASE_LOCK_COUNT (PHASE_MOLECULE_LOCK + 1)
+
+#ifdef PROJ2_INSTRUMENT
+// Histogram buckets: 2^HISTOGRAM_SUB_BITS linear buckets per power of two (HDR-style)
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+// Latency histogram in nanoseconds
+struct histogram {
+    uint64_t count;                       // Number of values
+    uint64_t sum;                         // Sum of values
+    uint64_t max;                         // Largest value
+    uint64_t buckets[HISTOGRAM_BUCKETS];  // Number of values in every bucket
+};
+
+// Instrumentation counters (shared memory, updated atomically)
+struct instrument {
+    struct histogram phases[PHASE_COUNT];  // Latency of every phase
+    uint64_t acquires[PHASE_LOCK_COUNT];   // Number of lock acquires
+    uint64_t contended[PHASE_LOCK_COUNT];  // Acquires which had to wait
+};
+
+// Instrumentation counters
+struct instrument* instrument = NULL;
+#endif
+
+// Shared memory backends
+typedef enum {
+    SHM_SYSV,   // SysV shmget/shmat (default)
+    SHM_POSIX,  // POSIX shm_open/mmap
+} shm_backend_t;
+
+// Size of huge page (segment size is rounded to it)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Shared memory segment
+struct segment {
+    shm_backend_t backend;  // Backend
+    bool hugepages;         // Back segment by huge pages
+    size_t size;            // Size of mapping
+    char name[32];          // POSIX shared memory object name (empty once unlinked)
+} segment;
+
+// CPU placement policies of atoms and pool workers
+typedef enum {
+    AFFINITY_NONE,     // Placement is left to the scheduler (default)
+    AFFINITY_COMPACT,  // Fill cores (and their siblings) of one NUMA node before the next one
+    AFFINITY_SCATTER,  // Spread consecutive atoms over NUMA nodes, then cores, then siblings
+    AFFINITY_LIST,     // Explicit CPU list
+} affinity_policy_t;
+
+const char* affinity_names[] = {[AFFINITY_NONE] = "none", [AFFINITY_COMPACT] = "compact",
+                                [AFFINITY_SCATTER] = "scatter", [AFFINITY_LIST] = "list"};
+
+// Maximal NUMA node the shared segment can be bound to
+#define AFFINITY_MAX_NODES 64
+
+// Memory policy of mbind() (not in glibc headers)
+#define AFFINITY_MPOL_PREFERRED 1
+#define AFFINITY_MPOL_MF_MOVE (1 << 1)
+
+// CPU placement (atom or worker N runs on cpus[N % count])
+struct affinity {
+    affinity_policy_t policy;    // Placement policy
+    uint16_t cpus[CPU_SETSIZE];  // CPUs in placement order
+    int16_t nodes[CPU_SETSIZE];  // NUMA node of every CPU in placement order
+    uint32_t count;              // Number of CPUs in placement order
+    int node;                    // NUMA node shared segment is bound to (-1 for none)
+} affinity = {.node = -1};
+
+// Offsets of variable sized parts of shared memory segment
+struct shared_layout {
+    size_t log_ring;          // Ring log lines
+    uint32_t log_ring_slots;  // Number of ring log lines
+    size_t molecule_times;    // Benchmark molecule durations
+    size_t reactors;          // Bonding reactors
+    size_t reactor_steals;    // Hydrogens stolen between every pair of reactors
+    size_t replay_gates;      // Turn and arrivals of every molecule (replay)
+    size_t replay_bonds;      // Release of hydrogens of every molecule (replay)
+    size_t instrument;        // Instrumentation counters
+    size_t trace;             // Atom lifecycles
+    size_t size;              // Total size
+};
+
 // Shared memory
-int shmid;
+int shmid = -1;
 struct s_shared* shared = NULL;
 
+// Reactor of the running atom (set per thread, reactor 0 outside of atoms)
+__thread struct reactor* reactor = NULL;
+
+// Waiting of atoms in queues for their partners
+struct queue_wait {
+    bool block;         // Always block right away
+    bool fixed;         // Spin budget was given on command line (no adaptation)
+    uint32_t spins;     // Initial or fixed spin budget (polls with pause)
+    uint32_t spin_max;  // Upper bound of adaptive spin budget (UINT32_MAX picks default)
+    uint32_t yields;    // Polls after sched_yield() before blocking
+} queue_wait = {.spins = 64, .spin_max = UINT32_MAX, .yields = 4};
+
+// Default upper bound of adaptive spin budget (on more than one CPU)
+#define QUEUE_SPIN_MAX 1024
+
+// Sharded bonding configuration
+struct sharding {
+    uint32_t count;   // Number of reactors
+    bool hash;        // Atoms are assigned by hash of their id (round-robin otherwise)
+    bool steal;       // Hydrogens left over in one reactor are moved to unmatched oxygens
+    bool shard_ids;   // Molecules are numbered per reactor (globally in batches otherwise)
+} sharding = {.count = 1};
+
+// Magic bytes at the start of recording
+#define REPLAY_MAGIC "H2OREC1"
+
+// Recording header
+struct replay_header {
+    char magic[8];         // REPLAY_MAGIC
+    uint32_t record_size;  // Size of one record
+    uint32_t no;           // Number of oxygens
+    uint32_t nh;           // Number of hydrogens
+    uint32_t molecules;    // Number of molecules
+};
+
+// Recorded atom (oxygens first, then hydrogens)
+struct replay_record {
+    uint32_t molecule;      // Molecule in bonding order (0 for leftover)
+    uint32_t init_millis;   // Milliseconds slept in initialization
+    uint32_t build_millis;  // Milliseconds slept in molecule creation (oxygen only)
+};
+
+// Record and replay of bonding decisions and sleeps
+struct replay {
+    char* record;                  // Recording written by this run (NULL if disabled)
+    char* replay;                  // Recording replayed by this run (NULL if disabled)
+    struct replay_header* header;  // Mapped recording
+    struct replay_record* atoms;   // Recorded atoms
+    size_t size;                   // Size of mapping
+    uint32_t oxygen_count;         // Number of oxygens (index of first hydrogen)
+} replay;
+
+// Magic bytes at the start of metrics block
+#define METRICS_MAGIC "H2OMET1"
+
+// Layout version of metrics block (published once the header is filled in)
+#define METRICS_VERSION 2
+
+// Event counters of one atom type (own cache line, atoms bump only their type)
+struct metrics_type {
+    uint64_t events[EVENT_COUNT];  // Logged events of every kind
+} CACHE_ALIGNED;
+
+// Live metrics of a run (named POSIX shared memory read by --stats=PID)
+struct metrics {
+    char magic[8];              // METRICS_MAGIC
+    uint32_t ready;             // METRICS_VERSION once header is filled in (release store)
+    uint32_t size;              // Size of block
+    uint32_t kind_count;        // Number of atom types
+    char kinds[LOG_MAX_KINDS];  // Atom type letters in recipe order
+    uint32_t parties;           // Number of atoms in one molecule
+    uint32_t molecules;         // Number of molecules to be created (0 if unknown)
+    uint32_t stream;            // Atoms arrive on stdin or socket (--stream)
+    uint64_t start;             // Monotonic time of start in nanoseconds
+    uint64_t finish;            // Monotonic time the run ended (0 while running)
+
+    // Molecule phase waits (written by atoms of every molecule)
+    uint64_t waits CACHE_ALIGNED;  // Number of waits for leader or followers (barrier)
+    uint64_t wait_ns;              // Total time of the waits
+
+    // Stream mode input (written under stream engine mutex)
+    uint64_t backlog CACHE_ALIGNED;  // Arrived atoms without thread
+    uint64_t pauses;                 // Times input reading paused for backpressure
+    uint64_t paused_ns;              // Total time of ended pauses
+    uint64_t paused_since;           // Monotonic start of current pause (0 while reading)
+
+    struct metrics_type types[LOG_MAX_KINDS];  // Event counters of every atom type
+};
+
+// One reading of live metrics (--stats)
+struct metrics_sample {
+    uint64_t time;                   // Monotonic time of reading (end time once finished)
+    bool finished;                   // Run has ended
+    uint64_t lines;                  // Logged lines
+    uint64_t molecules;              // Completed molecules
+    uint64_t leftovers;              // Atoms which ended with not enough
+    uint64_t waits;                  // Molecule phase waits
+    uint64_t wait_ns;                // Total time of molecule phase waits
+    uint64_t backlog;                // Stream mode atoms without thread
+    uint64_t pauses;                 // Stream mode input pauses
+    uint64_t paused_ns;              // Total time of input pauses including current one
+    uint64_t queued[LOG_MAX_KINDS];  // Atoms of every type in bonding queue
+};
+
+// Live metrics export and attach tool
+struct live {
+    bool enabled;           // Export metrics of this run (--metrics)
+    pid_t attach;           // Print metrics of run of this process (--stats=PID, 0 for none)
+    uint32_t interval;      // Milliseconds between printed samples
+    char name[32];          // POSIX shared memory object name (empty if none)
+    struct metrics* block;  // Mapped metrics (NULL if disabled)
+} live = {.interval = 1000};
+
+// Estimated memory of one atom process (kernel stack, page tables, copied pages)
+#define PLAN_PROCESS_BYTES (96 * 1024)
+
+// Estimated memory of one thread: resident part of its ATOM_THREAD_STACK_SIZE
+// stack (about 9 kB measured of the 64 kB reserved) plus its descriptor
+#define PLAN_THREAD_BYTES (ATOM_THREAD_STACK_SIZE / 4)
+
+// Tasks left to the rest of the system and to helper threads (log drainer)
+#define PLAN_TASK_MARGIN 16
+
+// Pre-flight capacity plan of the run (UINT64_MAX stands for no limit)
+struct plan {
+    bool auto_engine;       // Pick the first of fork, threads and pool engine that fits
+    bool print;             // Print plan and exit without running (--plan)
+    uint64_t nproc;         // RLIMIT_NPROC (not enforced for root)
+    uint64_t cgroup_tasks;  // Tasks left under pids.max of cgroup
+    uint64_t pid_max;       // kernel.pid_max
+    uint64_t threads_max;   // kernel.threads-max
+    uint64_t running;       // Tasks running on the system
+    uint64_t user_tasks;    // Tasks of this user (counted only with RLIMIT_NPROC)
+    uint64_t tasks_free;    // Tasks the run may have alive at once
+    uint64_t memory_free;   // Bytes the run may use (MemAvailable, memory.max of cgroup)
+    uint64_t tasks;         // Tasks needed by the engine
+    uint64_t memory;        // Bytes needed by the engine (shared segment included)
+    uint64_t segment;       // Size of shared segment
+} plan;
+
 // Output file stream
 FILE* log_stream;
 
+// Log backend selected on command line
+log_backend_t log_option = LOG_DEFAULT;
+
+// Log backend in use
+#ifdef PROJ2_LOG
+#define log_backend ((log_backend_t)PROJ2_LOG)
+#else
+log_backend_t log_backend = LOG_DEFAULT;
+#endif
+
+// Process that opened the log (finalizes binary log)
+pid_t log_owner;
+
+// Ring log drainer (lives only in the process that opened the log)
+struct log_drainer {
+    pid_t pid;               // Process running the drainer thread
+    pthread_t thread;        // Drainer thread
+    bool stop;               // Drain remaining lines and stop
+    bool lock;               // Held while lines are being moved to the file
+    char buffer[64 * 1024];  // Lines waiting for write()
+    size_t length;           // Number of bytes in buffer
+} log_drainer;
+
+/**
+ * @brief Seed random generator of one atom
+ *
+ * Seed is derived from base seed and atom identity with splitmix64, so every
+ * atom gets an independent sequence and runs with the same base seed repeat.
+ *
+ * @param rng Random generator
+ * @param seed Base seed
+ * @param id Atom id
+ * @param oxygen true for oxygen, false for hydrogen
+ */
+void rng_seed(rng_t* rng, uint64_t seed, uint32_t id, bool oxygen) {
+    uint64_t z = seed + ((uint64_t)id << 1 | oxygen) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    z ^= z >> 31;
+    rng->state = z != 0 ? z : 1;
+}
+
+/**
+ * Get next random number
+ *
+ * @param rng Random generator
+ * @return Random 32-bit number
+ */
+uint32_t rng_next(rng_t* rng) {
+    uint64_t x = rng->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+    return (x * 0x2545f4914f6cdd1d) >> 32;
+}
+
+/**
+ * Get random time
+ *
+ * @param rng Random generator
+ * @param millis Maximum number of milliseconds
+ * @return Random number of milliseconds in range <0, millis>
+ */
+uint32_t rand_millis(rng_t* rng, uint32_t millis) {
+    return ((uint64_t)rng_next(rng) * (millis + 1)) >> 32;
+}
+
+/**
+ * Wait some time
+ *
+ * @param rng Random generator
+ * @param millis Maximum number of milliseconds to sleep
+ */
+void wait_rand(rng_t* rng, uint32_t millis) {
+    if (bench.enabled) {
+        return;
+    }
+    uint32_t time = rand_millis(rng, millis);
+    usleep(time * 1000);
+}
+
+/**
+ * Get number of molecules that can be created
+ *
+ * @param args Parsed command line arguments
+ * @return Number of molecules
+ */
+uint32_t molecule_total(arguments_t args) {
+    if (!recipe.generic) {
+        return args.no < args.nh / 2 ? args.no : args.nh / 2;
+    }
+    uint32_t total = UINT32_MAX;
+    for (uint32_t i = 0; i < recipe.types; i++) {
+        if (recipe.atoms[i] / recipe.needed[i] < total) {
+            total = recipe.atoms[i] / recipe.needed[i];
+        }
+    }
+    return total;
+}
+
+/**
+ * Get monotonic time
+ *
+ * @return Monotonic time in nanoseconds
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Get start time of molecule creation
+ *
+ * @return Monotonic time in nanoseconds in benchmark mode, 0 otherwise
+ */
+uint64_t bench_start() {
+    return bench.enabled ? now_ns() : 0;
+}
+
+/**
+ * @brief Record duration of molecule creation (benchmark mode)
+ *
+ * Durations take slots in the order molecules finish, molecule ids may be
+ * sparse or repeat across reactors.
+ *
+ * @param start Start time returned by bench_start()
+ */
+void bench_molecule(uint64_t start) {
+    if (bench.molecule_times == NULL) {
+        return;
+    }
+    uint32_t slot = __atomic_fetch_add(&shared->molecules_timed, 1, __ATOMIC_RELAXED);
+    if (slot < bench.molecule_count) {
+        bench.molecule_times[slot] = now_ns() - start;
+    }
+}
+
+/**
+ * @brief Record end of atom work (benchmark mode)
+ *
+ * The last atom marks the start of teardown (reaping, log close, semaphore
+ * destruction).
+ *
+ * @param args Parsed command line arguments
+ */
+void bench_atom_end(arguments_t args) {
+    if (!bench.enabled) {
+        return;
+    }
+    if (__atomic_add_fetch(&shared->atoms_ended, 1, __ATOMIC_RELAXED) == args.no + args.nh) {
+        __atomic_store_n(&shared->atoms_ended_at, now_ns(), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Record point of atom lifecycle (trace export)
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @param point Lifecycle point
+ */
+void trace_point(bool oxygen, uint32_t id, trace_point_t point) {
+    if (trace.atoms == NULL) {
+        return;
+    }
+    struct trace_atom* atom = &trace.atoms[oxygen ? id - 1 : trace.oxygen_count + id - 1];
+    atom->time[point] = now_ns();
+    if (point == TRACE_STARTED) {
+        atom->pid = getpid();
+    }
+}
+
+#ifdef PROJ2_INSTRUMENT
+/**
+ * Get histogram bucket of value
+ *
+ * @param value Value in nanoseconds
+ * @return Bucket index
+ */
+uint32_t histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+           ((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/**
+ * Get lowest value of histogram bucket
+ *
+ * @param bucket Bucket index
+ * @return Value in nanoseconds
+ */
+uint64_t histogram_value(uint32_t bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return (uint64_t)((1 << HISTOGRAM_SUB_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)))
+           << shift;
+}
+
+/**
+ * Get percentile of histogram
+ *
+ * @param histogram Histogram
+ * @param percentile Percentile (0-100)
+ * @return Lowest value of bucket containing percentile in microseconds
+ */
+double histogram_percentile_us(struct histogram* histogram, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return histogram_value(i) / 1000.0;
+        }
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Get start time of instrumented phase
+ *
+ * @return Monotonic time in nanoseconds if instrumented, 0 otherwise
+ */
+uint64_t phase_start() {
+#ifdef PROJ2_INSTRUMENT
+    return now_ns();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Record duration of instrumented phase
+ *
+ * @param phase Phase
+ * @param start Start time returned by phase_start()
+ */
+void phase_end(phase_t phase, uint64_t start) {
+#ifdef PROJ2_INSTRUMENT
+    uint64_t duration = now_ns() - start;
+    struct histogram* histogram = &instrument->phases[phase];
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[histogram_bucket(duration)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (duration > max && !__atomic_compare_exchange_n(&histogram->max, &max, duration, true,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    (void)phase;
+    (void)start;
+#endif
+}
+
+/**
+ * Count lock acquire (instrumented builds)
+ *
+ * @param phase Lock wait phase
+ * @param contended Lock was not free
+ */
+void lock_count(phase_t phase, bool contended) {
+#ifdef PROJ2_INSTRUMENT
+    __atomic_add_fetch(&instrument->acquires[phase], 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&instrument->contended[phase], 1, __ATOMIC_RELAXED);
+    }
+#else
+    (void)phase;
+    (void)contended;
+#endif
+}
+
+/**
+ * @brief Wait on semaphore of reactor, queues spin and yield before blocking
+ *
+ * Partner often arrives within microseconds of a queued atom, so waiting in
+ * queue first polls. Spin budget of every queue follows twice the number of
+ * polls recent handoffs took, waits which end up blocked halve it.
+ *
+ * @param sem Semaphore
+ */
+void sem_wait_adaptive(Sem sem) {
+    sync_sem_t* semaphore = &reactor->semaphores[sem].sem;
+    if (sem == SEM_MUTEX || queue_wait.block) {
+        sync_sem_wait(semaphore);
+        return;
+    }
+    uint32_t* budget = &reactor->spin_budget[sem];
+    uint32_t spins =
+        queue_wait.fixed ? queue_wait.spins : __atomic_load_n(budget, __ATOMIC_RELAXED);
+    uint32_t polls = sync_sem_wait_spin(semaphore, spins, queue_wait.yields);
+    if (queue_wait.fixed) {
+        return;
+    }
+    uint32_t target = polls < spins ? 2 * polls + 16 : spins / 2;
+    if (polls >= spins && polls < spins + queue_wait.yields) {
+        target = 2 * spins + 16;
+    }
+    target = target < queue_wait.spin_max ? target : queue_wait.spin_max;
+    __atomic_store_n(budget, spins + ((int32_t)target - (int32_t)spins) / 8, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait on semaphore, wait time and contention are recorded in instrumented builds
+ *
+ * @param sem Semaphore
+ */
+void sem_acquire(Sem sem) {
+#ifdef PROJ2_INSTRUMENT
+    uint64_t start = phase_start();
+    bool contended = !sync_sem_trywait(&reactor->semaphores[sem].sem);
+    if (contended) {
+        sem_wait_adaptive(sem);
+    }
+    lock_count((phase_t)sem, contended);
+    phase_end((phase_t)sem, start);
+#else
+    sem_wait_adaptive(sem);
+#endif
+}
+
+/**
+ * Lock mutex, wait time and contention are recorded in instrumented builds
+ *
+ * @param mutex Mutex
+ * @param phase Lock wait phase
+ */
+void mutex_acquire(sync_mutex_t* mutex, phase_t phase) {
+#ifdef PROJ2_INSTRUMENT
+    uint64_t start = phase_start();
+    bool contended = !sync_mutex_trylock(mutex);
+    if (contended) {
+        sync_mutex_lock(mutex);
+    }
+    lock_count(phase, contended);
+    phase_end(phase, start);
+#else
+    (void)phase;
+    sync_mutex_lock(mutex);
+#endif
+}
+
+/**
+ * Count logged event (live metrics)
+ *
+ * @param type Atom type index
+ * @param event Event
+ */
+void metrics_event(uint32_t type, log_event_t event) {
+    if (live.block != NULL) {
+        __atomic_fetch_add(&live.block->types[type].events[event], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Get start time of molecule phase wait
+ *
+ * @return Monotonic time in nanoseconds with live metrics, 0 otherwise
+ */
+uint64_t metrics_start() {
+    return live.block != NULL ? now_ns() : 0;
+}
+
+/**
+ * Record molecule phase wait (live metrics)
+ *
+ * @param start Start time returned by metrics_start()
+ */
+void metrics_wait(uint64_t start) {
+    if (live.block != NULL) {
+        __atomic_fetch_add(&live.block->waits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&live.block->wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Wait for leader of molecule to release phase
+ *
+ * Wait time is recorded in instrumented builds and in live metrics.
+ *
+ * @param round Round token taken after the atom was woken from queue
+ * @param count Phase of molecule (1 creating, 2 created)
+ * @param phase Instrumented phase
+ */
+void group_wait(uint32_t round, uint32_t count, phase_t phase) {
+    uint64_t start = phase_start();
+    uint64_t waited = metrics_start();
+    sync_group_wait(&reactor->group, round, count);
+    phase_end(phase, start);
+    metrics_wait(waited);
+}
+
+/**
+ * @brief Wait for all followers of molecule
+ *
+ * Wait time is recorded in instrumented builds and in live metrics.
+ *
+ * @param phase Instrumented phase
+ */
+void group_collect(phase_t phase) {
+    uint64_t start = phase_start();
+    uint64_t waited = metrics_start();
+    sync_group_collect(&reactor->group);
+    phase_end(phase, start);
+    metrics_wait(waited);
+}
+
+/**
+ * Print per-phase latency histograms and lock contention (instrumented builds, stderr)
+ */
+void instrument_report() {
+#ifdef PROJ2_INSTRUMENT
+    const char* names[] = {
+        [PHASE_MUTEX] = "mutex",
+        [PHASE_OXYGEN_QUEUE] = "oxygen queue",
+        [PHASE_HYDROGEN_QUEUE] = "hydrogen queue",
+        [PHASE_LOG_LOCK] = "log lock",
+        [PHASE_MOLECULE_LOCK] = "molecule lock",
+        [PHASE_GROUP_BOND] = "group bond",
+        [PHASE_GROUP_BUILT] = "group built",
+        [PHASE_GROUP_DONE] = "group done",
+        [PHASE_INIT] = "init sleep",
+        [PHASE_BUILD] = "build sleep",
+    };
+
+    fprintf(stderr, "%-16s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean us",
+            "p50 us", "p90 us", "p99 us", "max us");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        struct histogram* histogram = &instrument->phases[i];
+        if (histogram->count == 0) {
+            continue;
+        }
+        fprintf(stderr, "%-16s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i],
+                histogram->count, histogram->sum / 1000.0 / histogram->count,
+                histogram_percentile_us(histogram, 50), histogram_percentile_us(histogram, 90),
+                histogram_percentile_us(histogram, 99), histogram->max / 1000.0);
+    }
+
+    fprintf(stderr, "%-16s %10s %10s %10s\n", "lock", "acquires", "contended", "ratio");
+    for (int i = 0; i < PHASE_LOCK_COUNT; i++) {
+        if (instrument->acquires[i] == 0) {
+            continue;
+        }
+        fprintf(stderr, "%-16s %10" PRIu64 " %10" PRIu64 " %9.1f%%\n", names[i],
+                instrument->acquires[i], instrument->contended[i],
+                100.0 * instrument->contended[i] / instrument->acquires[i]);
+    }
+#endif
+}
+
+/**
+ * Initialize all semaphores, mutexes, barriers and groups
+ *
+ * @param pshared true if they are shared between processes
+ * @return true if successful, false otherwise
+ */
+bool init_semaphores(bool pshared) {
+    // Initial semaphore values
+    unsigned int values[] = {[SEM_OXYGEN_QUEUE] = 0, [SEM_HYDROGEN_QUEUE] = 0, [SEM_MUTEX] = 1};
+
+    for (uint32_t r = 0; r < shared->reactor_count; r++) {
+        struct reactor* current = &shared->reactors[r];
+        for (int i = 0; i < SEM_COUNT; i++) {
+            if (!sync_sem_init(&current->semaphores[i].sem, pshared, values[i])) {
+                return false;
+            }
+        }
+        if (!sync_mutex_init(&current->molecule_mutex, pshared) ||
+            !sync_group_init(&current->group, pshared, recipe.parties - 1)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < RECIPE_MAX_TYPES; i++) {
+        if (!sync_sem_init(&shared->recipe_queues[i].sem, pshared, 0)) {
+            return false;
+        }
+    }
+
+    if (!sync_mutex_init(&shared->log_mutex, pshared) ||
+        !sync_mutex_init(&shared->reaped_mutex, pshared)) {
+        return false;
+    }
+
+    for (int i = 0; i < MOLECULE_SLOTS; i++) {
+        if (!sync_barrier_init(&shared->molecule_slots[i].barrier, pshared, 3)) {
+            return false;
+        }
+    }
+
+    // Molecule 1 has its turn right away
+    for (uint32_t i = 0; replay.replay != NULL && i < replay.header->molecules + 2; i++) {
+        if (!sync_sem_init(&shared->replay_gates[i], pshared, i == 1) ||
+            !sync_sem_init(&shared->replay_bonds[i], pshared, 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Destroy all semaphores, mutexes, barriers and groups
+ */
+void destroy_semaphores() {
+    for (uint32_t r = 0; r < shared->reactor_count; r++) {
+        struct reactor* current = &shared->reactors[r];
+        for (int i = 0; i < SEM_COUNT; i++) {
+            sync_sem_destroy(&current->semaphores[i].sem);
+        }
+        sync_mutex_destroy(&current->molecule_mutex);
+        sync_group_destroy(&current->group);
+    }
+    for (int i = 0; i < RECIPE_MAX_TYPES; i++) {
+        sync_sem_destroy(&shared->recipe_queues[i].sem);
+    }
+    sync_mutex_destroy(&shared->log_mutex);
+    sync_mutex_destroy(&shared->reaped_mutex);
+    for (int i = 0; i < MOLECULE_SLOTS; i++) {
+        sync_barrier_destroy(&shared->molecule_slots[i].barrier);
+    }
+    for (uint32_t i = 0; replay.replay != NULL && i < replay.header->molecules + 2; i++) {
+        sync_sem_destroy(&shared->replay_gates[i]);
+        sync_sem_destroy(&shared->replay_bonds[i]);
+    }
+}
+
+/**
+ * Detach from shared memory
+ */
+void detach_shared() {
+    if (segment.backend == SHM_SYSV) {
+        shmdt(shared);
+    } else {
+        munmap(shared, segment.size);
+    }
+}
+
+/**
+ * Round size up to multiple of alignment
+ *
+ * @param size Size
+ * @param alignment Alignment (power of two)
+ * @return Rounded size
+ */
+size_t align_size(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * @brief Compute shared memory layout
+ *
+ * Variable sized arrays are placed after struct s_shared and sized from NO/NH
+ *
+ * @param args Parsed command line arguments
+ * @return Layout of the segment
+ */
+struct shared_layout shared_layout(arguments_t args) {
+    struct shared_layout layout = {0};
+    size_t offset = align_size(sizeof(struct s_shared), CACHE_LINE_SIZE);
+
+    if (log_backend == LOG_RING) {
+        uint64_t lines = 4 * ((uint64_t)args.no + args.nh);
+        layout.log_ring_slots = LOG_RING_MIN_SLOTS;
+        while (layout.log_ring_slots < LOG_RING_MAX_SLOTS && layout.log_ring_slots < lines / 16) {
+            layout.log_ring_slots *= 2;
+        }
+        layout.log_ring = offset;
+        offset += sizeof(struct log_slot) * layout.log_ring_slots;
+    }
+
+    if (bench.enabled) {
+        layout.molecule_times = offset;
+        offset = align_size(offset + sizeof(uint64_t) * molecule_total(args), CACHE_LINE_SIZE);
+    }
+
+    if (replay.replay != NULL) {
+        uint64_t gates = (uint64_t)molecule_total(args) + 2;
+        layout.replay_gates = offset;
+        offset += sizeof(sync_sem_t) * gates;
+        layout.replay_bonds = offset;
+        offset = align_size(offset + sizeof(sync_sem_t) * gates, CACHE_LINE_SIZE);
+    }
+
+    layout.reactors = offset;
+    offset += sizeof(struct reactor) * sharding.count;
+    layout.reactor_steals = offset;
+    offset = align_size(offset + sizeof(uint32_t) * sharding.count * sharding.count,
+                        CACHE_LINE_SIZE);
+
+    if (trace.output != NULL) {
+        layout.trace = offset;
+        offset = align_size(offset + sizeof(struct trace_atom) * ((uint64_t)args.no + args.nh),
+                            CACHE_LINE_SIZE);
+    }
+
+#ifdef PROJ2_INSTRUMENT
+    layout.instrument = offset;
+    offset = align_size(offset + sizeof(struct instrument), CACHE_LINE_SIZE);
+#endif
+
+    layout.size = align_size(offset, segment.hugepages ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE));
+    return layout;
+}
+
+/**
+ * @brief Parse CPU list (e.g. 0,2,4-7), CPUs are appended in the given order
+ *
+ * @param str The list to be parsed
+ * @param cpus Parsed CPUs (CPU_SETSIZE items)
+ * @param count Number of parsed CPUs
+ * @return true if list is valid, false otherwise
+ */
+bool parse_cpu_list(const char* str, uint16_t* cpus, uint32_t* count) {
+    *count = 0;
+    while (true) {
+        char* end;
+        unsigned long first = strtoul(str, &end, 10);
+        unsigned long last = first;
+        if (end == str) {
+            return false;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoul(str, &end, 10);
+            if (end == str || last < first) {
+                return false;
+            }
+        }
+        if (last >= CPU_SETSIZE || *count + (last - first) >= CPU_SETSIZE) {
+            return false;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            cpus[(*count)++] = cpu;
+        }
+        if (*end == '\0' || *end == '\n') {
+            return true;
+        }
+        if (*end != ',') {
+            return false;
+        }
+        str = end + 1;
+    }
+}
+
+/**
+ * Read number from sysfs file
+ *
+ * @param path File path
+ * @return Number or -1 if file can't be read
+ */
+int read_sysfs_number(const char* path) {
+    FILE* file = fopen(path, "r");
+    int number = -1;
+    if (file != NULL) {
+        if (fscanf(file, "%d", &number) != 1) {
+            number = -1;
+        }
+        fclose(file);
+    }
+    return number;
+}
+
+/**
+ * Read NUMA node of every CPU (all CPUs are on node 0 without NUMA sysfs)
+ *
+ * @param nodes Node of every CPU (CPU_SETSIZE items)
+ * @return Number of NUMA nodes
+ */
+int read_cpu_nodes(int16_t* nodes) {
+    memset(nodes, 0, sizeof(int16_t) * CPU_SETSIZE);
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return 1;
+    }
+    int node_count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1 || node >= AFFINITY_MAX_NODES) {
+            continue;
+        }
+        char path[300];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        node_count++;
+        uint16_t cpus[CPU_SETSIZE];
+        uint32_t count = 0;
+        if (fgets(list, sizeof(list), file) != NULL && parse_cpu_list(list, cpus, &count)) {
+            for (uint32_t i = 0; i < count; i++) {
+                nodes[cpus[i]] = node;
+            }
+        }
+        fclose(file);
+    }
+    closedir(dir);
+    return node_count > 0 ? node_count : 1;
+}
+
+// CPU with its sort key (placement order)
+struct affinity_cpu {
+    int key[4];    // Sort key, compared lexicographically
+    uint16_t cpu;  // CPU number
+};
+
+/**
+ * Compare CPUs by sort key (qsort callback)
+ */
+int compare_affinity_cpus(const void* a, const void* b) {
+    const struct affinity_cpu* x = a;
+    const struct affinity_cpu* y = b;
+    for (int i = 0; i < 4; i++) {
+        if (x->key[i] != y->key[i]) {
+            return x->key[i] < y->key[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Order allowed CPUs by placement policy
+ *
+ * Compact order sorts CPUs by node, package, core and number, so hyperthread
+ * siblings are next to each other. Scatter order takes compact order and
+ * sorts it by sibling index, core index within node and node, so consecutive
+ * atoms land on different nodes and different physical cores first.
+ *
+ * @param allowed CPUs the process may run on
+ * @param nodes NUMA node of every CPU
+ */
+void order_affinity_cpus(cpu_set_t* allowed, int16_t* nodes) {
+    static struct affinity_cpu cpus[CPU_SETSIZE];
+    uint32_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, allowed)) {
+            continue;
+        }
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+                 cpu);
+        int package = read_sysfs_number(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        int core = read_sysfs_number(path);
+        cpus[count++] = (struct affinity_cpu){{nodes[cpu], package, core < 0 ? cpu : core, cpu},
+                                              cpu};
+    }
+    qsort(cpus, count, sizeof(cpus[0]), compare_affinity_cpus);
+
+    if (affinity.policy == AFFINITY_SCATTER) {
+        int previous[3] = {-1, -1, -1};
+        int core_index = 0;
+        int sibling = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            struct affinity_cpu* cpu = &cpus[i];
+            int node = cpu->key[0];
+            if (node != previous[0]) {
+                core_index = 0;
+                sibling = 0;
+            } else if (cpu->key[1] != previous[1] || cpu->key[2] != previous[2]) {
+                core_index++;
+                sibling = 0;
+            } else {
+                sibling++;
+            }
+            memcpy(previous, cpu->key, sizeof(previous));
+            cpu->key[0] = sibling;
+            cpu->key[1] = core_index;
+            cpu->key[2] = node;
+        }
+        qsort(cpus, count, sizeof(cpus[0]), compare_affinity_cpus);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        affinity.cpus[i] = cpus[i].cpu;
+    }
+    affinity.count = count;
+}
+
+/**
+ * @brief Prepare CPU placement of atoms and pool workers
+ *
+ * Shared segment is later bound to the NUMA node which runs most of the
+ * atoms (pool workers for pool engine), so the bonding counters stay local.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool init_affinity(arguments_t args) {
+    if (affinity.policy == AFFINITY_NONE) {
+        return true;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return false;
+    }
+    static int16_t nodes[CPU_SETSIZE];
+    int node_count = read_cpu_nodes(nodes);
+
+    if (affinity.policy == AFFINITY_LIST) {
+        for (uint32_t i = 0; i < affinity.count; i++) {
+            if (!CPU_ISSET(affinity.cpus[i], &allowed)) {
+                fprintf(stderr, "CPU %u is not available\n", affinity.cpus[i]);
+                return false;
+            }
+        }
+    } else {
+        order_affinity_cpus(&allowed, nodes);
+    }
+
+    // Every CPU slot runs units / count atoms, the first units % count one more
+    uint64_t units = args.engine == ENGINE_POOL ? args.workers : (uint64_t)args.no + args.nh;
+    units = stream.enabled ? 3 * stream.slots : units;
+    uint64_t weights[AFFINITY_MAX_NODES] = {0};
+    for (uint32_t i = 0; i < affinity.count; i++) {
+        affinity.nodes[i] = nodes[affinity.cpus[i]];
+        weights[affinity.nodes[i]] += units / affinity.count + (i < units % affinity.count);
+    }
+    for (int node = 0; node_count > 1 && node < AFFINITY_MAX_NODES; node++) {
+        if (affinity.node == -1 || weights[node] > weights[affinity.node]) {
+            affinity.node = node;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Bind memory to NUMA node chosen by init_affinity()
+ *
+ * Preferred policy is used, so memory still comes from other nodes when the
+ * node runs out of it. Pages which are already faulted in are migrated.
+ *
+ * @param memory Start of mapping
+ * @param size Size of mapping
+ */
+void affinity_bind(void* memory, size_t size) {
+    if (affinity.node == -1) {
+        return;
+    }
+    unsigned long mask = 1UL << affinity.node;
+    if (syscall(SYS_mbind, memory, size, AFFINITY_MPOL_PREFERRED, &mask,
+                sizeof(mask) * CHAR_BIT + 1, AFFINITY_MPOL_MF_MOVE) == -1) {
+        fprintf(stderr, "NUMA binding not available, segment is not bound\n");
+        affinity.node = -1;
+    }
+}
+
+/**
+ * Pin calling process or thread to its CPU of placement order
+ *
+ * @param index Atom index (worker index for pool engine)
+ */
+void affinity_pin(uint64_t index) {
+    if (affinity.policy == AFFINITY_NONE) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinity.cpus[index % affinity.count], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * @brief Map SysV shared memory segment
+ *
+ * Segment is marked for removal right after it is attached, children
+ * inherit the attachment and the kernel frees it once the last process
+ * detaches, so nothing is left behind even when the parent is killed.
+ *
+ * @param size Size of segment
+ * @return Mapped segment or NULL
+ */
+void* map_sysv(size_t size) {
+    shmid = -1;
+    if (segment.hugepages) {
+        shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | SHM_HUGETLB | 0666);
+        if (shmid == -1) {
+            fprintf(stderr, "Huge pages not available, using normal pages\n");
+        }
+    }
+    if (shmid == -1) {
+        shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0666);
+    }
+    if (shmid == -1) {
+        return NULL;
+    }
+
+    void* memory = shmat(shmid, NULL, 0);
+    shmctl(shmid, IPC_RMID, NULL);
+    return memory != (void*)-1 ? memory : NULL;
+}
+
+/**
+ * @brief Map POSIX shared memory segment
+ *
+ * Huge pages can't back shm_open objects (they live on tmpfs), so a shared
+ * anonymous MAP_HUGETLB mapping inherited by all children is used instead.
+ * Object is unlinked as soon as it is mapped, only the inherited mappings
+ * keep it alive.
+ *
+ * @param size Size of segment
+ * @return Mapped segment or NULL
+ */
+void* map_posix(size_t size) {
+    if (segment.hugepages) {
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (memory != MAP_FAILED) {
+            return memory;
+        }
+        fprintf(stderr, "Huge pages not available, using normal pages\n");
+    }
+
+    snprintf(segment.name, sizeof(segment.name), "/proj2-%d", getpid());
+    int fd = shm_open(segment.name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        segment.name[0] = '\0';
+        return NULL;
+    }
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    shm_unlink(segment.name);
+    segment.name[0] = '\0';
+    return memory != MAP_FAILED ? memory : NULL;
+}
+
+/**
+ * Get reactor an atom is assigned to before stealing
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @return Reactor index
+ */
+uint32_t reactor_home(bool oxygen, uint32_t id) {
+    if (!sharding.hash) {
+        return (id - 1) % sharding.count;
+    }
+    uint64_t z = ((uint64_t)id << 1 | oxygen) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 31)) * 0xbf58476d1ce4e5b9;
+    return (z ^ (z >> 29)) % sharding.count;
+}
+
+/**
+ * @brief Plan atoms and molecules of every reactor
+ *
+ * Counts of assigned atoms are known up front, so every reactor knows how
+ * many molecules it creates and how many leftovers it has. With work
+ * stealing, hydrogens a reactor can't use are planned to move to reactors
+ * with unmatched oxygens before any atom runs and before any "not enough"
+ * decision, so all reactors together create min(NO, NH / 2) molecules.
+ * Hydrogens arriving to their home reactor last are the ones which move.
+ *
+ * @param args Parsed command line arguments
+ */
+void init_reactors(arguments_t args) {
+    struct reactor* reactors = shared->reactors;
+    if (sharding.count == 1 || recipe.generic) {
+        reactors[0].oxygens = args.no;
+        reactors[0].hydrogens = args.nh;
+        reactors[0].hydrogen_keep = args.nh;
+        reactors[0].molecules = molecule_total(args);
+        return;
+    }
+
+    // Home assignment (closed form for round-robin)
+    for (uint32_t r = 0; r < sharding.count; r++) {
+        if (!sharding.hash) {
+            reactors[r].oxygens = args.no / sharding.count + (r < args.no % sharding.count);
+            reactors[r].hydrogens = args.nh / sharding.count + (r < args.nh % sharding.count);
+        }
+    }
+    for (uint32_t id = 1; sharding.hash && id <= args.no; id++) {
+        reactors[reactor_home(true, id)].oxygens++;
+    }
+    for (uint32_t id = 1; sharding.hash && id <= args.nh; id++) {
+        reactors[reactor_home(false, id)].hydrogens++;
+    }
+    for (uint32_t r = 0; r < sharding.count; r++) {
+        struct reactor* current = &reactors[r];
+        current->molecules = current->oxygens < current->hydrogens / 2 ? current->oxygens
+                                                                      : current->hydrogens / 2;
+        current->hydrogen_keep = current->hydrogens;
+    }
+    if (!sharding.steal) {
+        return;
+    }
+
+    // Reactors with unmatched oxygens create the molecules missing to the global count
+    uint32_t extra = molecule_total(args);
+    for (uint32_t r = 0; r < sharding.count; r++) {
+        extra -= reactors[r].molecules;
+    }
+    for (uint32_t r = 0; r < sharding.count && extra > 0; r++) {
+        while (reactors[r].oxygens > reactors[r].molecules && extra > 0) {
+            reactors[r].molecules++;
+            extra--;
+        }
+    }
+
+    // Hydrogens they miss are taken from reactors with spare ones
+    uint32_t donor = 0;
+    for (uint32_t r = 0; r < sharding.count; r++) {
+        struct reactor* receiver = &reactors[r];
+        while (receiver->hydrogens < 2 * receiver->molecules && donor < sharding.count) {
+            struct reactor* giver = &reactors[donor];
+            if (giver->hydrogens <= 2 * giver->molecules) {
+                donor++;
+                continue;
+            }
+            uint32_t missing = 2 * receiver->molecules - receiver->hydrogens;
+            uint32_t spare = giver->hydrogens - 2 * giver->molecules;
+            uint32_t moved = missing < spare ? missing : spare;
+            giver->hydrogens -= moved;
+            giver->hydrogen_keep -= moved;
+            giver->hydrogen_steals[r] += moved;
+            receiver->hydrogens += moved;
+        }
+    }
+}
+
+/**
+ * @brief Assign atom to its reactor
+ *
+ * Hydrogen arriving to its home reactor after all hydrogens it keeps is
+ * stolen by the reactor planned by init_reactors().
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @return Reactor
+ */
+struct reactor* reactor_assign(bool oxygen, uint32_t id) {
+    struct reactor* home = &shared->reactors[reactor_home(oxygen, id)];
+    if (oxygen || !sharding.steal || sharding.count == 1) {
+        return home;
+    }
+    uint32_t arrived = __atomic_fetch_add(&home->hydrogen_arrived, 1, __ATOMIC_RELAXED);
+    if (arrived < home->hydrogen_keep) {
+        return home;
+    }
+    arrived -= home->hydrogen_keep;
+    for (uint32_t r = 0; r < sharding.count; r++) {
+        if (arrived < home->hydrogen_steals[r]) {
+            return &shared->reactors[r];
+        }
+        arrived -= home->hydrogen_steals[r];
+    }
+    return home;
+}
+
+/**
+ * @brief Get id of molecule just counted by reactor (molecule mutex must be held)
+ *
+ * Single reactor and per-reactor numbering use the reactor count, sharded
+ * reactors otherwise take up to REACTOR_ID_BATCH ids from the global counter
+ * at once. Batches never exceed molecules the reactor has left, so ids of all
+ * reactors together are exactly 1 to M.
+ *
+ * @return Molecule id
+ */
+uint32_t reactor_molecule_id() {
+    if (sharding.count == 1 || sharding.shard_ids) {
+        return reactor->molecule_count;
+    }
+    if (reactor->batch_left == 0) {
+        uint32_t left = reactor->molecules - reactor->molecule_count + 1;
+        uint32_t batch = left < REACTOR_ID_BATCH ? left : REACTOR_ID_BATCH;
+        reactor->batch_next =
+            __atomic_fetch_add(&shared->molecule_next, batch, __ATOMIC_RELAXED) + 1;
+        reactor->batch_left = batch;
+    }
+    reactor->batch_left--;
+    return reactor->batch_next++;
+}
+
+/**
+ * @brief Initialize shared memory
+ *
+ * Segment is sized from NO/NH and its backing pages are allocated up front
+ * by the parent. Only the parent address space is pre-faulted (threads and
+ * pool engines), fork children still map every page they touch with a minor
+ * fault of their own, no page is allocated or zeroed then.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool init_shared(arguments_t args) {
+    struct shared_layout layout = shared_layout(args);
+    segment.size = layout.size;
+    shared = segment.backend == SHM_SYSV ? map_sysv(layout.size) : map_posix(layout.size);
+    if (shared == NULL) {
+        return false;
+    }
+
+    atexit(detach_shared);
+    affinity_bind(shared, layout.size);
+
+    // Touching every page allocates the segment and pre-faults it in this process
+    memset(shared, 0, layout.size);
+
+    shared->log_line_number = 1;
+    shared->waiting = 0;
+    shared->molecules_done = 0;
+    for (uint32_t i = 0; i < HANDOFF_SLOTS; i++) {
+        shared->oxygen_handoff.sequence[i] = i;
+        shared->hydrogen_handoff.sequence[i] = i;
+    }
+    for (uint32_t i = 0; i < MOLECULE_SLOTS; i++) {
+        shared->molecule_slots[i].owner = i + 1;
+        shared->molecule_slots[i].left = 0;
+    }
+
+    char* base = (char*)shared;
+    shared->log_ring = (struct log_slot*)(base + layout.log_ring);
+    shared->log_ring_slots = layout.log_ring_slots;
+    shared->reactors = (struct reactor*)(base + layout.reactors);
+    shared->reactor_count = sharding.count;
+    for (uint32_t i = 0; i < sharding.count; i++) {
+        shared->reactors[i].hydrogen_steals =
+            (uint32_t*)(base + layout.reactor_steals) + i * sharding.count;
+        for (int j = 0; j < SEM_COUNT; j++) {
+            shared->reactors[i].spin_budget[j] = queue_wait.spins;
+        }
+    }
+    reactor = &shared->reactors[0];
+    init_reactors(args);
+    if (replay.replay != NULL) {
+        shared->replay_gates = (sync_sem_t*)(base + layout.replay_gates);
+        shared->replay_bonds = (sync_sem_t*)(base + layout.replay_bonds);
+    }
+    if (bench.enabled) {
+        bench.molecule_times = (uint64_t*)(base + layout.molecule_times);
+        bench.molecule_count = molecule_total(args);
+    }
+    if (trace.output != NULL) {
+        trace.atoms = (struct trace_atom*)(base + layout.trace);
+        trace.oxygen_count = args.no;
+    }
+#ifdef PROJ2_INSTRUMENT
+    instrument = (struct instrument*)(base + layout.instrument);
+#endif
+
+    return true;
+}
+
+/**
+ * @brief Create live metrics block (--metrics)
+ *
+ * Block is a small POSIX shared memory object named by PID of the parent,
+ * so any process can attach to it with --stats=PID. It is mapped before
+ * atoms are started, children inherit the mapping.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool init_metrics(arguments_t args) {
+    if (!live.enabled) {
+        return true;
+    }
+    snprintf(live.name, sizeof(live.name), "/proj2-metrics-%d", getpid());
+    int fd = shm_open(live.name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        live.name[0] = '\0';
+        return false;
+    }
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct metrics)) == 0) {
+        memory = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(live.name);
+        live.name[0] = '\0';
+        return false;
+    }
+
+    live.block = memory;
+    memcpy(live.block->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+    live.block->size = sizeof(struct metrics);
+    live.block->kind_count = recipe.types;
+    memcpy(live.block->kinds, recipe.kinds, recipe.types);
+    live.block->parties = recipe.parties;
+    live.block->molecules = stream.enabled ? 0 : molecule_total(args);
+    live.block->stream = stream.enabled;
+    live.block->start = now_ns();
+    __atomic_store_n(&live.block->ready, METRICS_VERSION, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Mark run in live metrics as ended and remove the block
+ *
+ * Attached readers keep their mapping, they see the end time and stop.
+ */
+void close_metrics() {
+    if (live.block == NULL) {
+        return;
+    }
+    __atomic_store_n(&live.block->finish, now_ns(), __ATOMIC_RELEASE);
+    shm_unlink(live.name);
+    live.name[0] = '\0';
+}
+
+/**
+ * Write whole buffer to file descriptor
+ *
+ * @param fd File descriptor
+ * @param data Data to be written
+ * @param length Number of bytes
+ */
+void write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+/**
+ * @brief Move all ready lines from ring buffer to drainer buffer
+ *
+ * Lines are consumed strictly in line number order, the buffer is written out
+ * when full or when there is nothing more to consume.
+ *
+ * @return Number of consumed lines
+ */
+uint32_t log_drain() {
+    uint32_t consumed = 0;
+    uint32_t next = shared->log_drained;
+    while (true) {
+        struct log_slot* slot = &shared->log_ring[next & (shared->log_ring_slots - 1)];
+        if (__atomic_load_n(&slot->line, __ATOMIC_ACQUIRE) != next) {
+            break;
+        }
+        if (log_drainer.length + slot->length > sizeof(log_drainer.buffer)) {
+            write_all(shared->log_fd, log_drainer.buffer, log_drainer.length);
+            log_drainer.length = 0;
+        }
+        memcpy(log_drainer.buffer + log_drainer.length, slot->text, slot->length);
+        log_drainer.length += slot->length;
+        next++;
+        consumed++;
+        __atomic_store_n(&shared->log_drained, next, __ATOMIC_RELEASE);
+    }
+    if (log_drainer.length > 0) {
+        write_all(shared->log_fd, log_drainer.buffer, log_drainer.length);
+        log_drainer.length = 0;
+    }
+    return consumed;
+}
+
+/**
+ * Ring log drainer thread
+ *
+ * @param arg Unused
+ * @return Always NULL
+ */
+void* log_drainer_thread(void* arg) {
+    (void)arg;
+    struct timespec idle = {.tv_sec = 0, .tv_nsec = 100000};
+    while (true) {
+        // Read stop flag before draining, so nothing written before stop is missed
+        bool stop = __atomic_load_n(&log_drainer.stop, __ATOMIC_ACQUIRE);
+        while (__atomic_exchange_n(&log_drainer.lock, true, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        uint32_t consumed = log_drain();
+        __atomic_store_n(&log_drainer.lock, false, __ATOMIC_RELEASE);
+        if (stop) {
+            break;
+        }
+        if (consumed == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fatal signal handler, flushes ring log before the process dies
+ *
+ * The drainer thread has these signals blocked, so the drainer lock is never
+ * held by the interrupted thread. The lock is never released, the drainer
+ * can't run again. Children only re-raise the signal, their lines are
+ * already in the ring buffer.
+ *
+ * @param sig Signal number
+ */
+void log_crash_handler(int sig) {
+    if (getpid() != log_drainer.pid) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    while (__atomic_exchange_n(&log_drainer.lock, true, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    log_drain();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * @brief Open binary log
+ *
+ * File is sized for the maximal number of lines (4 per atom) and mapped, so
+ * writers only fill their record. It is truncated to real length at close.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool open_log_binary(arguments_t args) {
+    shared->log_fd = open(LOG_BINARY_FILE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (shared->log_fd == -1) {
+        return false;
+    }
+
+    shared->log_records = 4 * ((uint64_t)args.no + args.nh);
+    size_t size = sizeof(struct log_header) + sizeof(struct log_record) * shared->log_records;
+    void* map = MAP_FAILED;
+    if (ftruncate(shared->log_fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shared->log_fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(shared->log_fd);
+        return false;
+    }
+
+    shared->log_header = map;
+    memcpy(shared->log_header->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    shared->log_header->record_size = sizeof(struct log_record);
+    shared->log_header->kind_count = recipe.types;
+    memcpy(shared->log_header->kinds, recipe.kinds, recipe.types);
+    log_owner = getpid();
+    return true;
+}
+
+/**
+ * @brief Open memory mapped text log
+ *
+ * proj2.out is sized for the maximal number of lines (4 per atom) of maximal
+ * length and mapped, writers copy lines straight into it. It is truncated to
+ * real length at close.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool open_log_mmap(arguments_t args) {
+    uint64_t lines = 4 * ((uint64_t)args.no + args.nh);
+    if (lines > LOG_MMAP_LINE_MASK) {
+        fprintf(stderr, "Too many atoms for mapped log\n");
+        return false;
+    }
+
+    shared->log_fd = open("proj2.out", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (shared->log_fd == -1) {
+        return false;
+    }
+
+    shared->log_map_size = lines * LOG_MMAP_LINE_SIZE;
+    void* map = MAP_FAILED;
+    if (ftruncate(shared->log_fd, shared->log_map_size) == 0) {
+        map = mmap(NULL, shared->log_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   shared->log_fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(shared->log_fd);
+        return false;
+    }
+
+    shared->log_map = map;
+    shared->log_position = 0;
+    log_owner = getpid();
+    return true;
+}
+
+/**
+ * Open text log (stdout in stream mode, proj2.out otherwise)
+ *
+ * @return File descriptor or -1
+ */
+int open_log_text() {
+    if (stream.enabled) {
+        return dup(STDOUT_FILENO);
+    }
+    return open("proj2.out", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+/**
+ * Open log file
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool open_log(arguments_t args) {
+    if (log_backend == LOG_STDIO) {
+        shared->log_fd = open_log_text();
+        return shared->log_fd != -1;
+    }
+    if (log_backend == LOG_BINARY) {
+        return open_log_binary(args);
+    }
+    if (log_backend == LOG_MMAP) {
+        return open_log_mmap(args);
+    }
+
+    shared->log_fd = open_log_text();
+    if (shared->log_fd == -1) {
+        return false;
+    }
+    shared->log_drained = 1;
+
+    // Fatal signals are handled by other threads than the drainer, SIGCHLD is read by reaper
+    const int fatal[] = {SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGABRT};
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+        sigaddset(&mask, fatal[i]);
+    }
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    log_drainer.pid = getpid();
+    int error = pthread_create(&log_drainer.thread, NULL, log_drainer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (error) {
+        close(shared->log_fd);
+        return false;
+    }
+
+    if (args.crash_flush) {
+        for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+            signal(fatal[i], log_crash_handler);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Close log file
+ *
+ * In the process owning the ring log drainer all remaining lines are flushed first
+ */
+void close_log() {
+    if (log_backend == LOG_STDIO) {
+        close(shared->log_fd);
+        return;
+    }
+
+    if (log_backend == LOG_BINARY) {
+        if (log_owner == getpid()) {
+            uint64_t lines = shared->log_line_number - 1;
+            size_t size = sizeof(struct log_header) + sizeof(struct log_record) * lines;
+            shared->log_header->records = lines;
+            munmap(shared->log_header,
+                   sizeof(struct log_header) + sizeof(struct log_record) * shared->log_records);
+            if (ftruncate(shared->log_fd, size) == -1) {
+                fprintf(stderr, "Could not truncate binary log\n");
+            }
+        }
+        close(shared->log_fd);
+        return;
+    }
+
+    if (log_backend == LOG_MMAP) {
+        if (log_owner == getpid()) {
+            uint64_t position = __atomic_load_n(&shared->log_position, __ATOMIC_ACQUIRE);
+            shared->log_line_number = (position & LOG_MMAP_LINE_MASK) + 1;
+            munmap(shared->log_map, shared->log_map_size);
+            if (ftruncate(shared->log_fd, position >> LOG_MMAP_LINE_BITS) == -1) {
+                fprintf(stderr, "Could not truncate log file\n");
+            }
+        }
+        close(shared->log_fd);
+        return;
+    }
+
+    if (log_drainer.pid == getpid()) {
+        __atomic_store_n(&log_drainer.stop, true, __ATOMIC_RELEASE);
+        pthread_join(log_drainer.thread, NULL);
+    }
+    close(shared->log_fd);
+}
+
+/**
+ * @brief Check that recording fits the run
+ *
+ * Every molecule must have exactly one oxygen and two hydrogens.
+ *
+ * @param args Parsed command line arguments
+ * @return true if valid, false otherwise
+ */
+bool replay_valid(arguments_t args) {
+    struct replay_header* header = replay.header;
+    uint64_t atoms = (uint64_t)args.no + args.nh;
+    if (replay.size < sizeof(struct replay_header) ||
+        memcmp(header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) ||
+        header->record_size != sizeof(struct replay_record) ||
+        (replay.size - sizeof(struct replay_header)) / sizeof(struct replay_record) < atoms) {
+        fprintf(stderr, "Invalid recording %s\n", replay.replay);
+        return false;
+    }
+    if (header->no != args.no || header->nh != args.nh) {
+        fprintf(stderr, "Recording %s is of NO=%u NH=%u\n", replay.replay, header->no, header->nh);
+        return false;
+    }
+
+    uint8_t* parties = calloc((uint64_t)header->molecules + 1, 1);
+    if (parties == NULL) {
+        return false;
+    }
+    bool valid = header->molecules == molecule_total(args);
+    for (uint64_t i = 0; i < atoms && valid; i++) {
+        uint32_t molecule = replay.atoms[i].molecule;
+        valid = molecule <= header->molecules;
+        if (valid && molecule > 0) {
+            parties[molecule] += i < args.no ? 1 : 16;
+        }
+    }
+    for (uint32_t i = 1; i <= header->molecules && valid; i++) {
+        valid = parties[i] == 33;
+    }
+    free(parties);
+    if (!valid) {
+        fprintf(stderr, "Invalid recording %s\n", replay.replay);
+    }
+    return valid;
+}
+
+/**
+ * @brief Open recording
+ *
+ * Recording is sized for all atoms and mapped shared, every atom fills only
+ * its own record, so recording takes no locks. Recording to be replayed is
+ * mapped read only and checked.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool open_replay(arguments_t args) {
+    const char* name = replay.record != NULL ? replay.record : replay.replay;
+    if (name == NULL) {
+        return true;
+    }
+    int fd = replay.record != NULL ? open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)
+                                   : open(name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open recording %s\n", name);
+        return false;
+    }
+
+    void* map = MAP_FAILED;
+    struct stat st;
+    if (replay.record != NULL) {
+        replay.size = sizeof(struct replay_header) +
+                      sizeof(struct replay_record) * ((uint64_t)args.no + args.nh);
+        if (ftruncate(fd, replay.size) == 0) {
+            map = mmap(NULL, replay.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+    } else if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        replay.size = st.st_size;
+        map = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map recording %s\n", name);
+        return false;
+    }
+
+    replay.header = map;
+    replay.atoms = (struct replay_record*)(replay.header + 1);
+    replay.oxygen_count = args.no;
+    if (replay.replay != NULL) {
+        if (!replay_valid(args)) {
+            munmap(map, replay.size);
+            return false;
+        }
+        return true;
+    }
+    memcpy(replay.header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    replay.header->record_size = sizeof(struct replay_record);
+    replay.header->no = args.no;
+    replay.header->nh = args.nh;
+    replay.header->molecules = molecule_total(args);
+    return true;
+}
+
+/**
+ * Close recording
+ */
+void close_replay() {
+    if (replay.header != NULL) {
+        munmap(replay.header, replay.size);
+        replay.header = NULL;
+    }
+}
+
+/**
+ * @brief Ring log writer
+ *
+ * Claims line number with atomic fetch-add and copies the line straight into
+ * its ring buffer slot, waiting only if the drainer is a whole ring behind.
+ *
+ * @param text Formatted event
+ * @param length Length of text
+ */
+void flog_ring(const char* text, size_t length) {
+    uint32_t line = __atomic_fetch_add(&shared->log_line_number, 1, __ATOMIC_RELAXED);
+    while (line - __atomic_load_n(&shared->log_drained, __ATOMIC_ACQUIRE) >=
+           shared->log_ring_slots) {
+        sched_yield();
+    }
+
+    struct log_slot* slot = &shared->log_ring[line & (shared->log_ring_slots - 1)];
+    size_t prefix_length = log_format_prefix(slot->text, line);
+    assert(prefix_length + length <= sizeof(slot->text));  // Guaranteed by slot size
+    memcpy(slot->text + prefix_length, text, length);
+    slot->length = prefix_length + length;
+    __atomic_store_n(&slot->line, line, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write line to memory mapped log
+ *
+ * Line number and byte range are reserved together with one compare-and-swap
+ * of packed position, so lines are in file in the order of their numbers.
+ *
+ * @param text Formatted event
+ * @param length Length of text
+ */
+void flog_mmap(const char* text, size_t length) {
+    char prefix[LOG_PREFIX_MAX];
+    size_t prefix_length;
+    uint64_t offset, next;
+    uint64_t position = __atomic_load_n(&shared->log_position, __ATOMIC_RELAXED);
+    do {
+        uint32_t line = (position & LOG_MMAP_LINE_MASK) + 1;
+        prefix_length = log_format_prefix(prefix, line);
+        offset = position >> LOG_MMAP_LINE_BITS;
+        next = (offset + prefix_length + length) << LOG_MMAP_LINE_BITS | line;
+    } while (!__atomic_compare_exchange_n(&shared->log_position, &position, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (offset + prefix_length + length <= shared->log_map_size) {
+        memcpy(shared->log_map + offset, prefix, prefix_length);
+        memcpy(shared->log_map + offset + prefix_length, text, length);
+    }
+}
+
+/**
+ * @brief Logging function - thread/process safe
+ *
+ * Event is formatted into a stack buffer before any lock is taken, stdio
+ * backend then writes the whole line with a single write() under log mutex.
+ *
+ * @param kind Atom type letter
+ * @param id Atom id
+ * @param event Event
+ * @param molecule Molecule id (creating and created events)
+ * @param not_enough Text of "not enough" event of this atom type
+ */
+void flog(char kind, uint32_t id, log_event_t event, uint32_t molecule, const char* not_enough) {
+    char line[LOG_PREFIX_MAX + LOG_TEXT_MAX];
+    char* text = line + LOG_PREFIX_MAX;
+    size_t length = log_format_event(text, kind, id, event, molecule, not_enough);
+    if (log_backend == LOG_RING) {
+        flog_ring(text, length);
+        return;
+    }
+    if (log_backend == LOG_MMAP) {
+        flog_mmap(text, length);
+        return;
+    }
+
+    mutex_acquire(&shared->log_mutex, PHASE_LOG_LOCK);
+
+    // Prefix is written right in front of the text
+    char prefix[LOG_PREFIX_MAX];
+    size_t prefix_length = log_format_prefix(prefix, shared->log_line_number);
+    memcpy(text - prefix_length, prefix, prefix_length);
+    write_all(shared->log_fd, text - prefix_length, prefix_length + length);
+
+    shared->log_line_number++;
+
+    sync_mutex_unlock(&shared->log_mutex);
+}
+
+/**
+ * Write record to binary log
+ *
+ * @param kind Atom type letter
+ * @param id Atom id
+ * @param event Event
+ * @param molecule Molecule id (creating and created events)
+ */
+void flog_binary(char kind, uint32_t id, log_event_t event, uint32_t molecule) {
+    uint32_t line = __atomic_fetch_add(&shared->log_line_number, 1, __ATOMIC_RELAXED);
+    if (line > shared->log_records) {
+        return;
+    }
+
+    struct log_record* record = (struct log_record*)(shared->log_header + 1) + (line - 1);
+    record->kind = kind;
+    record->event = event;
+    record->id = id;
+    record->molecule = molecule;
+    record->timestamp = now_ns();
+    __atomic_store_n(&record->line, line, __ATOMIC_RELEASE);
+}
+
+/**
+ * Log atom event
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @param event Event
+ * @param molecule Molecule id (creating and created events)
+ */
+void log_event(bool oxygen, uint32_t id, log_event_t event, uint32_t molecule) {
+    metrics_event(oxygen ? 0 : 1, event);
+    if (trace.atoms != NULL) {
+        const trace_point_t points[] = {
+            [EVENT_STARTED] = TRACE_STARTED,   [EVENT_QUEUE] = TRACE_QUEUE,
+            [EVENT_CREATING] = TRACE_CREATING, [EVENT_CREATED] = TRACE_CREATED,
+            [EVENT_NOT_ENOUGH] = TRACE_NOT_ENOUGH,
+        };
+        trace_point(oxygen, id, points[event]);
+        if (event == EVENT_CREATING) {
+            trace.atoms[oxygen ? id - 1 : trace.oxygen_count + id - 1].molecule = molecule;
+        }
+    }
+    if (log_backend == LOG_BINARY) {
+        flog_binary(oxygen ? 'O' : 'H', id, event, molecule);
+        return;
+    }
+    flog(oxygen ? 'O' : 'H', id, event, molecule, recipe.not_enough[oxygen ? 0 : 1]);
+}
+
+/**
+ * Log event of generic recipe atom
+ *
+ * @param type Atom type index
+ * @param id Atom id
+ * @param event Event
+ * @param molecule Molecule id (creating and created events)
+ */
+void log_recipe_event(uint32_t type, uint32_t id, log_event_t event, uint32_t molecule) {
+    metrics_event(type, event);
+    if (log_backend == LOG_BINARY) {
+        flog_binary(recipe.kinds[type], id, event, molecule);
+        return;
+    }
+    flog(recipe.kinds[type], id, event, molecule, recipe.not_enough[type]);
+}
+
+/**
+ * @brief Parse number from string
+ *
+ * Exits program if number is not valid
+ *
+ * @param str The string to be parsed
+ * @param min Minimum valid value
+ * @param max Maximum valid value
+ * @return Parsed number
+ */
+unsigned long parse_argument(char* str, size_t min, size_t max) {
+    char* end;
+    unsigned long number = strtoul(str, &end, 10);
+    if (end == str || *end != '\0' || number > max || number < min) {
+        fprintf(stderr, "Invalid argument: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return number;
+}
+
+/**
+ * @brief Parse CPU placement policy (compact, scatter or CPU list)
+ *
+ * Exits program if policy is not valid
+ *
+ * @param str The policy to be parsed
+ */
+void parse_affinity(char* str) {
+    if (strcmp(str, "compact") == 0) {
+        affinity.policy = AFFINITY_COMPACT;
+    } else if (strcmp(str, "scatter") == 0) {
+        affinity.policy = AFFINITY_SCATTER;
+    } else if (parse_cpu_list(str, affinity.cpus, &affinity.count)) {
+        affinity.policy = AFFINITY_LIST;
+    } else {
+        fprintf(stderr, "Invalid affinity: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Parse molecule recipe (type letters followed by counts, e.g. O1H2 or CO2)
+ *
+ * Exits program if recipe is not valid
+ *
+ * @param str The recipe to be parsed
+ */
+void parse_recipe(char* str) {
+    recipe_t parsed = {0};
+    for (char* c = str; *c != '\0';) {
+        if (*c < 'A' || *c > 'Z' || parsed.types == RECIPE_MAX_TYPES ||
+            memchr(parsed.kinds, *c, parsed.types) != NULL) {
+            fprintf(stderr, "Invalid recipe: %s\n", str);
+            exit(EXIT_FAILURE);
+        }
+        parsed.kinds[parsed.types] = *c++;
+        unsigned long count = 1;
+        if (*c >= '0' && *c <= '9') {
+            count = strtoul(c, &c, 10);
+        }
+        if (count == 0 || count > RECIPE_MAX_PARTIES - parsed.parties) {
+            fprintf(stderr, "Invalid recipe: %s\n", str);
+            exit(EXIT_FAILURE);
+        }
+        parsed.parties += count;
+        parsed.needed[parsed.types++] = count;
+    }
+    if (parsed.types == 0) {
+        fprintf(stderr, "Invalid recipe: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+
+    // H2O keeps its specialized implementation
+    parsed.generic = !(parsed.types == 2 && parsed.kinds[0] == 'O' && parsed.kinds[1] == 'H' &&
+                       parsed.needed[0] == 1 && parsed.needed[1] == 2);
+    for (uint32_t i = 0; i < parsed.types; i++) {
+        log_not_enough_text(parsed.not_enough[i], parsed.kinds, parsed.types, i);
+    }
+    recipe = parsed;
+}
+
+/**
+ * @brief Parse command line option (--name=value)
+ *
+ * Exits program if option is not valid
+ *
+ * @param str The option to be parsed
+ * @param args Arguments structure to be filled
+ */
+void parse_option(char* str, arguments_t* args) {
+    if (strcmp(str, "--engine=fork") == 0) {
+        args->engine = ENGINE_FORK;
+        plan.auto_engine = false;
+    } else if (strcmp(str, "--engine=threads") == 0) {
+        args->engine = ENGINE_THREADS;
+        plan.auto_engine = false;
+    } else if (strcmp(str, "--engine=pool") == 0) {
+        args->engine = ENGINE_POOL;
+        plan.auto_engine = false;
+    } else if (strcmp(str, "--engine=auto") == 0) {
+        args->engine = ENGINE_DEFAULT;
+        plan.auto_engine = true;
+    } else if (strcmp(str, "--plan") == 0) {
+        plan.print = true;
+    } else if (strcmp(str, "--log=stdio") == 0) {
+        log_option = LOG_STDIO;
+    } else if (strcmp(str, "--log=ring") == 0) {
+        log_option = LOG_RING;
+    } else if (strcmp(str, "--log=mmap") == 0) {
+        log_option = LOG_MMAP;
+    } else if (strcmp(str, "--log-format=text") == 0) {
+        log_option = log_option == LOG_BINARY ? LOG_STDIO : log_option;
+    } else if (strcmp(str, "--log-format=binary") == 0) {
+        log_option = LOG_BINARY;
+    } else if (strcmp(str, "--bench") == 0) {
+        bench.enabled = true;
+    } else if (strncmp(str, "--bench-output=", 15) == 0) {
+        bench.enabled = true;
+        bench.output = str + 15;
+    } else if (strncmp(str, "--seed=", 7) == 0) {
+        args->seed = parse_argument(str + 7, 0, ULONG_MAX);
+        args->seeded = true;
+    } else if (strcmp(str, "--shm=sysv") == 0) {
+        segment.backend = SHM_SYSV;
+    } else if (strcmp(str, "--shm=posix") == 0) {
+        segment.backend = SHM_POSIX;
+    } else if (strcmp(str, "--hugepages") == 0) {
+        segment.hugepages = true;
+    } else if (strcmp(str, "--parallel-molecules") == 0) {
+        args->parallel = true;
+    } else if (strcmp(str, "--log-crash-flush") == 0) {
+        args->crash_flush = true;
+    } else if (strncmp(str, "--recipe=", 9) == 0) {
+        parse_recipe(str + 9);
+    } else if (strcmp(str, "--stream") == 0) {
+        stream.enabled = true;
+    } else if (strncmp(str, "--stream=", 9) == 0) {
+        stream.enabled = true;
+        stream.socket = str + 9;
+    } else if (strncmp(str, "--stream-slots=", 15) == 0) {
+        stream.slots = parse_argument(str + 15, 1, 65536);
+    } else if (strncmp(str, "--stream-backlog=", 17) == 0) {
+        stream.backlog = parse_argument(str + 17, 0, LONG_MAX);
+    } else if (strncmp(str, "--affinity=", 11) == 0) {
+        parse_affinity(str + 11);
+    } else if (strcmp(str, "--queue-wait=block") == 0) {
+        queue_wait.block = true;
+    } else if (strcmp(str, "--queue-wait=adaptive") == 0) {
+        queue_wait.block = false;
+    } else if (strncmp(str, "--spin=", 7) == 0) {
+        queue_wait.spins = parse_argument(str + 7, 0, UINT32_MAX);
+        queue_wait.fixed = true;
+    } else if (strncmp(str, "--spin-max=", 11) == 0) {
+        queue_wait.spin_max = parse_argument(str + 11, 0, UINT32_MAX / 4);
+    } else if (strncmp(str, "--spin-yields=", 14) == 0) {
+        queue_wait.yields = parse_argument(str + 14, 0, UINT32_MAX / 2);
+    } else if (strncmp(str, "--reactors=", 11) == 0) {
+        sharding.count = parse_argument(str + 11, 1, 256);
+    } else if (strcmp(str, "--reactor-assign=rr") == 0) {
+        sharding.hash = false;
+    } else if (strcmp(str, "--reactor-assign=hash") == 0) {
+        sharding.hash = true;
+    } else if (strncmp(str, "--record=", 9) == 0) {
+        replay.record = str + 9;
+    } else if (strncmp(str, "--replay=", 9) == 0) {
+        replay.replay = str + 9;
+    } else if (strcmp(str, "--reactor-steal") == 0) {
+        sharding.steal = true;
+    } else if (strcmp(str, "--reactor-ids=global") == 0) {
+        sharding.shard_ids = false;
+    } else if (strcmp(str, "--reactor-ids=shard") == 0) {
+        sharding.shard_ids = true;
+    } else if (strcmp(str, "--metrics") == 0) {
+        live.enabled = true;
+    } else if (strncmp(str, "--stats=", 8) == 0) {
+        live.attach = parse_argument(str + 8, 1, INT_MAX);
+    } else if (strncmp(str, "--stats-interval=", 17) == 0) {
+        live.interval = parse_argument(str + 17, 10, 3600000);
+    } else if (strncmp(str, "--trace=", 8) == 0) {
+        trace.output = str + 8;
+    } else if (strcmp(str, "--rusage") == 0) {
+        args->rusage = true;
+    } else if (strncmp(str, "--spawners=", 11) == 0) {
+        args->spawners = parse_argument(str + 11, 0, 4096);
+    } else if (strncmp(str, "--workers=", 10) == 0) {
+        args->workers = parse_argument(str + 10, 1, 4096);
+    } else {
+        fprintf(stderr, "Invalid option: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Wake all atoms of reactor which won't be part of any molecule
+ *
+ * Numbers of leftover atoms are known up front (NO - M oxygens and NH - 2M
+ * hydrogens for M molecules of the reactor), so all of them are woken by one
+ * batch post of every queue instead of each leftover waking the next one.
+ * Leftovers which are not in queue yet find their post there.
+ */
+void wake_leftovers() {
+    uint32_t molecules = reactor->molecules;
+    reactor->not_enough = true;
+    if (recipe.generic) {
+        for (uint32_t i = 0; i < recipe.types; i++) {
+            sync_sem_post_n(&shared->recipe_queues[i].sem,
+                            recipe.atoms[i] - molecules * recipe.needed[i]);
+        }
+        return;
+    }
+    sync_sem_post_n(&reactor->semaphores[SEM_OXYGEN_QUEUE].sem, reactor->oxygens - molecules);
+    sync_sem_post_n(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem,
+                    reactor->hydrogens - 2 * molecules);
+}
+
+/**
+ * Push molecule id to handoff queue
+ *
+ * @param queue Handoff queue
+ * @param molecule Molecule id
+ */
+void handoff_push(struct handoff* queue, uint32_t molecule) {
+    uint32_t position = __atomic_fetch_add(&queue->tail, 1, __ATOMIC_RELAXED);
+    uint32_t index = position % HANDOFF_SLOTS;
+    while (__atomic_load_n(&queue->sequence[index], __ATOMIC_ACQUIRE) != position) {
+        sched_yield();
+    }
+    queue->molecule[index] = molecule;
+    __atomic_store_n(&queue->sequence[index], position + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Pop molecule id from handoff queue
+ *
+ * Caller must be woken by a queue semaphore first, so the matching push is
+ * at least in progress.
+ *
+ * @param queue Handoff queue
+ * @return Molecule id
+ */
+uint32_t handoff_pop(struct handoff* queue) {
+    uint32_t position = __atomic_fetch_add(&queue->head, 1, __ATOMIC_RELAXED);
+    uint32_t index = position % HANDOFF_SLOTS;
+    while (__atomic_load_n(&queue->sequence[index], __ATOMIC_ACQUIRE) != position + 1) {
+        sched_yield();
+    }
+    uint32_t molecule = queue->molecule[index];
+    __atomic_store_n(&queue->sequence[index], position + HANDOFF_SLOTS, __ATOMIC_RELEASE);
+    return molecule;
+}
+
+/**
+ * @brief Enter lock-free bonding queue
+ *
+ * Waiting counts of both kinds are packed in one word, so an arrival that
+ * completes a triple (1 O, 2 H) claims it with a single compare-and-swap.
+ * The claiming atom allocates molecule id and hands it to its partners.
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @return Molecule id if this atom completed a triple, 0 otherwise
+ */
+uint32_t matcher_arrive(bool oxygen) {
+    uint64_t old = __atomic_load_n(&shared->waiting, __ATOMIC_RELAXED);
+    uint64_t new;
+    bool bond;
+    do {
+        uint64_t oxygens = (old >> 32) + oxygen;
+        uint64_t hydrogens = (old & UINT32_MAX) + !oxygen;
+        bond = oxygens >= 1 && hydrogens >= 2;
+        if (bond) {
+            oxygens -= 1;
+            hydrogens -= 2;
+        }
+        new = oxygens << 32 | hydrogens;
+    } while (!__atomic_compare_exchange_n(&shared->waiting, &old, new, true, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    if (!bond) {
+        return 0;
+    }
+
+    uint32_t molecule = __atomic_add_fetch(&reactor->molecule_count, 1, __ATOMIC_RELAXED);
+    if (oxygen) {
+        handoff_push(&shared->hydrogen_handoff, molecule);
+        handoff_push(&shared->hydrogen_handoff, molecule);
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+    } else {
+        handoff_push(&shared->oxygen_handoff, molecule);
+        handoff_push(&shared->hydrogen_handoff, molecule);
+        sync_sem_post(&reactor->semaphores[SEM_OXYGEN_QUEUE].sem);
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+    }
+    return molecule;
+}
+
+/**
+ * Get recorded atom
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @return Record of the atom
+ */
+struct replay_record* replay_atom(bool oxygen, uint32_t id) {
+    return &replay.atoms[oxygen ? id - 1 : replay.oxygen_count + id - 1];
+}
+
+/**
+ * @brief Wait some time, recorded or replayed
+ *
+ * Replay takes the recorded time instead of a random one, benchmark mode
+ * skips waiting either way.
+ *
+ * @param rng Random generator
+ * @param millis Maximum number of milliseconds to sleep
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @param build Wait is molecule creation (initialization otherwise)
+ */
+void replay_wait(rng_t* rng, uint32_t millis, bool oxygen, uint32_t id, bool build) {
+    if (replay.header == NULL) {
+        wait_rand(rng, millis);
+        return;
+    }
+    struct replay_record* atom = replay_atom(oxygen, id);
+    uint32_t* recorded = build ? &atom->build_millis : &atom->init_millis;
+    uint32_t time = replay.replay != NULL ? *recorded : rand_millis(rng, millis);
+    if (replay.record != NULL) {
+        *recorded = time;
+    }
+    if (!bench.enabled) {
+        usleep(time * 1000);
+    }
+}
+
+/**
+ * Record molecule of atom (record mode)
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @param molecule Molecule id
+ */
+void replay_note(bool oxygen, uint32_t id, uint32_t molecule) {
+    if (replay.record != NULL) {
+        replay_atom(oxygen, id)->molecule = molecule;
+    }
+}
+
+/**
+ * @brief Wait in queue for the recorded molecule (replay)
+ *
+ * Oxygen of molecule M waits for its turn (end of molecule M - 1) and for
+ * both its hydrogens, then releases them, so molecules are bonded from the
+ * same atoms in the same order as recorded. Leftovers wait in their queue
+ * for wake_leftovers() as usual.
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ */
+void replay_queue(bool oxygen, uint32_t id) {
+    uint32_t molecule = replay_atom(oxygen, id)->molecule;
+    if (molecule == 0) {
+        sem_acquire(oxygen ? SEM_OXYGEN_QUEUE : SEM_HYDROGEN_QUEUE);
+        return;
+    }
+    if (!oxygen) {
+        sync_sem_post(&shared->replay_gates[molecule]);
+        sync_sem_wait(&shared->replay_bonds[molecule]);
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        sync_sem_wait(&shared->replay_gates[molecule]);
+    }
+    sync_sem_post_n(&shared->replay_bonds[molecule], 2);
+}
+
+/**
+ * @brief Bond atom and create molecule, more molecules can be created at once
+ *
+ * Molecules synchronize on their own barrier from the slot pool, so
+ * independent molecules don't contend with each other.
+ *
+ * @param id Atom id
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param rng Random generator of the atom
+ * @param args Parsed command line arguments
+ */
+void bond_parallel(uint32_t id, bool oxygen, rng_t* rng, arguments_t args) {
+    // Wait for partners
+    uint32_t molecule = matcher_arrive(oxygen);
+    if (molecule == 0) {
+        sem_wait_adaptive(oxygen ? SEM_OXYGEN_QUEUE : SEM_HYDROGEN_QUEUE);
+
+        // Molecule ids are handed off before their molecules can finish, so
+        // once not_enough is set nobody is woken with a molecule id anymore
+        if (reactor->not_enough) {
+            log_event(oxygen, id, EVENT_NOT_ENOUGH, 0);
+            return;
+        }
+        molecule = handoff_pop(oxygen ? &shared->oxygen_handoff : &shared->hydrogen_handoff);
+    }
+    trace_point(oxygen, id, TRACE_WOKEN);
+
+    // Wait until previous molecule using the same slot is done
+    struct molecule_slot* slot = &shared->molecule_slots[(molecule - 1) % MOLECULE_SLOTS];
+    while (__atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE) != molecule) {
+        sched_yield();
+    }
+
+    // Oxygen builds the molecule, all are created once it is done
+    uint64_t start = bench_start();
+    log_event(oxygen, id, EVENT_CREATING, molecule);
+    if (oxygen) {
+        wait_rand(rng, args.tb);
+    }
+    uint64_t waited = metrics_start();
+    sync_barrier_wait(&slot->barrier);
+    metrics_wait(waited);
+    log_event(oxygen, id, EVENT_CREATED, molecule);
+    if (oxygen) {
+        bench_molecule(start);
+    }
+
+    // Last molecule releases all remaining atoms
+    if (oxygen &&
+        __atomic_add_fetch(&shared->molecules_done, 1, __ATOMIC_ACQ_REL) == molecule_total(args)) {
+        wake_leftovers();
+    }
+
+    // Pass slot to the next molecule
+    if (__atomic_add_fetch(&slot->left, 1, __ATOMIC_ACQ_REL) == 3) {
+        slot->left = 0;
+        __atomic_store_n(&slot->owner, molecule + MOLECULE_SLOTS, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Wait in queue until oxygen is bonded or is a leftover
+ *
+ * @param id Oxygen id
+ */
+void oxygen_queue(uint32_t id) {
+    if (replay.replay != NULL) {
+        replay_queue(true, id);
+        return;
+    }
+    sem_acquire(SEM_MUTEX);
+    reactor->oxygen_count++;
+    if (reactor->hydrogen_count >= 2) {
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+        reactor->hydrogen_count -= 2;
+        sync_sem_post(&reactor->semaphores[SEM_OXYGEN_QUEUE].sem);
+        reactor->oxygen_count--;
+    } else {
+        sync_sem_post(&reactor->semaphores[SEM_MUTEX].sem);
+    }
+    sem_acquire(SEM_OXYGEN_QUEUE);
+}
+
+/**
+ * Wait in queue until hydrogen is bonded or is a leftover
+ *
+ * @param id Hydrogen id
+ */
+void hydrogen_queue(uint32_t id) {
+    if (replay.replay != NULL) {
+        replay_queue(false, id);
+        return;
+    }
+    sem_acquire(SEM_MUTEX);
+    reactor->hydrogen_count++;
+    if (reactor->hydrogen_count >= 2 && reactor->oxygen_count >= 1) {
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+        sync_sem_post(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem);
+        reactor->hydrogen_count -= 2;
+        sync_sem_post(&reactor->semaphores[SEM_OXYGEN_QUEUE].sem);
+        reactor->oxygen_count--;
+    } else {
+        sync_sem_post(&reactor->semaphores[SEM_MUTEX].sem);
+    }
+    sem_acquire(SEM_HYDROGEN_QUEUE);
+}
+
+/**
+ * @brief Oxygen atom (child process or thread)
+ *
+ * Inspired by Little book of semaphores
+ * 5.6.2
+ *
+ * @param id Oxygen process id
+ * @param args Parsed command line arguments
+ */
+void oxygen_process(uint32_t id, arguments_t args) {
+    // Seed random generator
+    rng_t rng;
+    rng_seed(&rng, args.seed, id, true);
+
+    // Init
+    log_event(true, id, EVENT_STARTED, 0);
+    uint64_t init_start = phase_start();
+    replay_wait(&rng, args.ti, true, id, false);
+    phase_end(PHASE_INIT, init_start);
+    log_event(true, id, EVENT_QUEUE, 0);
+
+    if (args.parallel) {
+        bond_parallel(id, true, &rng, args);
+        return;
+    }
+
+    // Wait in queue
+    oxygen_queue(id);
+    trace_point(true, id, TRACE_WOKEN);
+
+    // Look if there is enough hydrogen
+    if (reactor->not_enough) {
+        log_event(true, id, EVENT_NOT_ENOUGH, 0);
+        return;
+    }
+
+    // Update counts
+    mutex_acquire(&reactor->molecule_mutex, PHASE_MOLECULE_LOCK);
+    reactor->molecule_count++;
+    reactor->molecule_id = reactor_molecule_id();
+    sync_mutex_unlock(&reactor->molecule_mutex);
+    replay_note(true, id, reactor->molecule_id);
+    uint64_t start = bench_start();
+    uint32_t molecule = reactor->molecule_id;
+
+    // Init molecule creation, hydrogens go along
+    sync_group_release(&reactor->group);
+    log_event(true, id, EVENT_CREATING, molecule);
+
+    // Create molecule (by waiting)
+    uint64_t build_start = phase_start();
+    replay_wait(&rng, args.tb, true, id, true);
+    phase_end(PHASE_BUILD, build_start);
+
+    // Molecule is created once all of its atoms are creating it
+    group_collect(PHASE_GROUP_BUILT);
+    log_event(true, id, EVENT_CREATED, molecule);
+    sync_group_release(&reactor->group);
+    bench_molecule(start);
+    group_collect(PHASE_GROUP_DONE);
+
+    // Last molecule wakes all leftover atoms at once
+    if (reactor->molecule_count == reactor->molecules) {
+        wake_leftovers();
+    }
+
+    // Finish (next molecule has its turn)
+    if (replay.replay != NULL) {
+        sync_sem_post(&shared->replay_gates[molecule + 1]);
+    } else {
+        sync_sem_post(&reactor->semaphores[SEM_MUTEX].sem);
+    }
+}
+
+/**
+ * @brief Hydrogen atom (child process or thread)
+ *
+ * Inspired by Little book of semaphores
+ * 5.6.2
+ *
+ * @param id Hydrogen process id
+ * @param args Parsed command line arguments
+ */
+void hydrogen_process(uint32_t id, arguments_t args) {
+    // Seed random generator
+    rng_t rng;
+    rng_seed(&rng, args.seed, id, false);
+
+    // Init
+    log_event(false, id, EVENT_STARTED, 0);
+    uint64_t init_start = phase_start();
+    replay_wait(&rng, args.ti, false, id, false);
+    phase_end(PHASE_INIT, init_start);
+    log_event(false, id, EVENT_QUEUE, 0);
+
+    if (args.parallel) {
+        bond_parallel(id, false, &rng, args);
+        return;
+    }
+
+    // Wait in queue
+    hydrogen_queue(id);
+    trace_point(false, id, TRACE_WOKEN);
+
+    // Look if there is enough O and H
+    if (reactor->not_enough) {
+        log_event(false, id, EVENT_NOT_ENOUGH, 0);
+        return;
+    }
+
+    // Init molecule creation once oxygen releases it
+    uint32_t round = sync_group_round(&reactor->group);
+    group_wait(round, 1, PHASE_GROUP_BOND);
+    uint32_t molecule = reactor->molecule_id;
+    replay_note(false, id, molecule);
+    log_event(false, id, EVENT_CREATING, molecule);
+    sync_group_arrive(&reactor->group);
+
+    // Molecule created
+    group_wait(round, 2, PHASE_GROUP_BUILT);
+    log_event(false, id, EVENT_CREATED, molecule);
+    sync_group_arrive(&reactor->group);
+}
+
+/**
+ * Run one atom (child process or thread)
+ *
+ * @param oxygen true for oxygen, false for hydrogen
+ * @param id Atom id
+ * @param args Parsed command line arguments
+ */
+void atom_process(bool oxygen, uint32_t id, arguments_t args) {
+    if (oxygen) {
+        oxygen_process(id, args);
+    } else {
+        hydrogen_process(id, args);
+    }
+    trace_point(oxygen, id, TRACE_EXIT);
+}
+
+/**
+ * Check if every type has enough atoms waiting in queue for one molecule
+ *
+ * @return true if molecule can be bonded
+ */
+bool recipe_complete() {
+    for (uint32_t i = 0; i < recipe.types; i++) {
+        if (shared->recipe_waiting[i] < recipe.needed[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Atom of generic recipe (child process or thread)
+ *
+ * Same protocol as oxygen_process() and hydrogen_process() with counts taken
+ * from recipe. The arrival completing a molecule wakes needed atoms of every
+ * type and keeps SEM_MUTEX until the molecule is done, first woken atom of the
+ * first type builds it. Matching costs O(number of types) per arrival.
+ *
+ * @param type Atom type index
+ * @param id Atom id
+ * @param args Parsed command line arguments
+ */
+void recipe_process(uint32_t type, uint32_t id, arguments_t args) {
+    // Seed random generator
+    rng_t rng;
+    rng_seed(&rng, args.seed ^ (uint64_t)type << 56, id, false);
+    sync_sem_t* queue = &shared->recipe_queues[type].sem;
+
+    // Init
+    log_recipe_event(type, id, EVENT_STARTED, 0);
+    wait_rand(&rng, args.ti);
+    log_recipe_event(type, id, EVENT_QUEUE, 0);
+
+    // Wait in queue
+    sem_acquire(SEM_MUTEX);
+    shared->recipe_waiting[type]++;
+    if (recipe_complete()) {
+        shared->recipe_built = false;
+        for (uint32_t i = 0; i < recipe.types; i++) {
+            for (uint32_t j = 0; j < recipe.needed[i]; j++) {
+                sync_sem_post(&shared->recipe_queues[i].sem);
+            }
+            shared->recipe_waiting[i] -= recipe.needed[i];
+        }
+    } else {
+        sync_sem_post(&reactor->semaphores[SEM_MUTEX].sem);
+    }
+    sync_sem_wait(queue);
+
+    // Woken as leftover
+    if (reactor->not_enough) {
+        log_recipe_event(type, id, EVENT_NOT_ENOUGH, 0);
+        return;
+    }
+
+    // Update counts, elect builder
+    bool builder = false;
+    mutex_acquire(&reactor->molecule_mutex, PHASE_MOLECULE_LOCK);
+    if (type == 0 && !shared->recipe_built) {
+        shared->recipe_built = true;
+        reactor->molecule_count++;
+        builder = true;
+    }
+    sync_mutex_unlock(&reactor->molecule_mutex);
+    uint64_t start = bench_start();
+
+    // Other atoms are led by the builder
+    if (!builder) {
+        uint32_t round = sync_group_round(&reactor->group);
+        group_wait(round, 1, PHASE_GROUP_BOND);
+        uint32_t molecule = reactor->molecule_count;
+        log_recipe_event(type, id, EVENT_CREATING, molecule);
+        sync_group_arrive(&reactor->group);
+        group_wait(round, 2, PHASE_GROUP_BUILT);
+        log_recipe_event(type, id, EVENT_CREATED, molecule);
+        sync_group_arrive(&reactor->group);
+        return;
+    }
+
+    // Create molecule
+    uint32_t molecule = reactor->molecule_count;
+    sync_group_release(&reactor->group);
+    log_recipe_event(type, id, EVENT_CREATING, molecule);
+    wait_rand(&rng, args.tb);
+    group_collect(PHASE_GROUP_BUILT);
+    log_recipe_event(type, id, EVENT_CREATED, molecule);
+    sync_group_release(&reactor->group);
+    bench_molecule(start);
+    group_collect(PHASE_GROUP_DONE);
+
+    // Last molecule wakes all leftover atoms at once
+    if (molecule == molecule_total(args)) {
+        wake_leftovers();
+    }
+
+    // Finish
+    sync_sem_post(&reactor->semaphores[SEM_MUTEX].sem);
+}
+
+/**
+ * Run atom with given index on its CPU (child process or thread)
+ *
+ * @param index Atom index (atoms of the first type first, in recipe order)
+ * @param args Parsed command line arguments
+ */
+void atom_run(uint64_t index, arguments_t args) {
+    affinity_pin(index);
+    if (!recipe.generic) {
+        bool oxygen = index < args.no;
+        uint32_t id = oxygen ? index + 1 : index - args.no + 1;
+        reactor = reactor_assign(oxygen, id);
+        atom_process(oxygen, id, args);
+        bench_atom_end(args);
+        return;
+    }
+    reactor = &shared->reactors[0];
+    uint32_t type = 0;
+    while (index >= recipe.atoms[type]) {
+        index -= recipe.atoms[type++];
+    }
+    recipe_process(type, index + 1, args);
+    bench_atom_end(args);
+}
+
+/**
+ * Add resource usage to statistics
+ *
+ * @param stats Statistics
+ * @param usage Resource usage of one child (or of the whole process)
+ */
+void reap_stats_usage(struct reap_stats* stats, struct rusage* usage) {
+    stats->user_us += (uint64_t)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+    stats->system_us += (uint64_t)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+    if ((uint64_t)usage->ru_maxrss > stats->max_rss_kb) {
+        stats->max_rss_kb = usage->ru_maxrss;
+    }
+    stats->voluntary += usage->ru_nvcsw;
+    stats->involuntary += usage->ru_nivcsw;
+    stats->minor_faults += usage->ru_minflt;
+    stats->major_faults += usage->ru_majflt;
+}
+
+/**
+ * Merge statistics of another reaper
+ *
+ * @param stats Statistics to be updated
+ * @param other Statistics to be added
+ */
+void reap_stats_merge(struct reap_stats* stats, struct reap_stats* other) {
+    stats->reaped += other->reaped;
+    stats->failed += other->failed;
+    stats->signaled += other->signaled;
+    stats->user_us += other->user_us;
+    stats->system_us += other->system_us;
+    if (other->max_rss_kb > stats->max_rss_kb) {
+        stats->max_rss_kb = other->max_rss_kb;
+    }
+    stats->voluntary += other->voluntary;
+    stats->involuntary += other->involuntary;
+    stats->minor_faults += other->minor_faults;
+    stats->major_faults += other->major_faults;
+}
+
+/**
+ * @brief Prepare reaping of children
+ *
+ * SIGCHLD is blocked and read from signalfd, so it has to be called before
+ * the first child is forked. Children inherit the blocked mask, atoms never
+ * have children of their own so it doesn't matter to them.
+ *
+ * @param reaper Reaper
+ */
+void reaper_init(reaper_t* reaper) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &reaper->old_mask);
+    reaper->fd = signalfd(-1, &mask, SFD_CLOEXEC);
+}
+
+/**
+ * Stop reaping of children, restore signal mask
+ *
+ * @param reaper Reaper
+ */
+void reaper_destroy(reaper_t* reaper) {
+    if (reaper->fd != -1) {
+        close(reaper->fd);
+    }
+    sigprocmask(SIG_SETMASK, &reaper->old_mask, NULL);
+}
+
+/**
+ * @brief Reap one batch of children
+ *
+ * Sleeps until at least one child exits and then reaps all children that are
+ * already gone without blocking, SIGCHLDs of more children coalesce into one
+ * signalfd read.
+ *
+ * @param reaper Reaper
+ * @param max Maximal number of reaped children
+ * @param stats Statistics updated with every reaped child
+ * @return Number of reaped children, 0 if there are no children left
+ */
+uint64_t reaper_batch(reaper_t* reaper, uint64_t max, struct reap_stats* stats) {
+    while (true) {
+        int flags = WNOHANG;
+        if (reaper->fd != -1) {
+            struct signalfd_siginfo info;
+            if (read(reaper->fd, &info, sizeof(info)) == -1 && errno != EINTR) {
+                close(reaper->fd);
+                reaper->fd = -1;
+            }
+        }
+        if (reaper->fd == -1) {
+            flags = 0;
+        }
+
+        uint64_t reaped = 0;
+        int status;
+        struct rusage usage;
+        pid_t pid = 0;
+        while (reaped < max && (pid = wait4(-1, &status, flags, &usage)) > 0) {
+            stats->reaped++;
+            if (WIFSIGNALED(status)) {
+                stats->signaled++;
+            } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                stats->failed++;
+            }
+            reap_stats_usage(stats, &usage);
+            reaped++;
+            flags = WNOHANG;
+        }
+        if (reaped > 0 || (pid == -1 && errno == ECHILD)) {
+            return reaped;
+        }
+    }
+}
+
+/**
+ * Reap given number of children
+ *
+ * @param reaper Reaper
+ * @param count Number of children
+ * @param stats Statistics updated with every reaped child
+ */
+void reaper_wait(reaper_t* reaper, uint64_t count, struct reap_stats* stats) {
+    uint64_t reaped = 0;
+    while (reaped < count) {
+        uint64_t batch = reaper_batch(reaper, count - reaped, stats);
+        if (batch == 0) {
+            break;
+        }
+        reaped += batch;
+    }
+}
+
+/**
+ * Print resource usage part of summary
+ *
+ * @param stats Statistics
+ */
+void reap_report_usage(struct reap_stats* stats) {
+    fprintf(stderr, "  cpu time:      user %.3f s, system %.3f s\n", stats->user_us / 1e6,
+            stats->system_us / 1e6);
+    fprintf(stderr, "  max rss:       %" PRIu64 " kB\n", stats->max_rss_kb);
+    fprintf(stderr, "  ctx switches:  %" PRIu64 " voluntary, %" PRIu64 " involuntary\n",
+            stats->voluntary, stats->involuntary);
+    fprintf(stderr, "  page faults:   %" PRIu64 " minor, %" PRIu64 " major\n",
+            stats->minor_faults, stats->major_faults);
+}
+
+/**
+ * Print summary of reaped children
+ *
+ * @param name Name of children
+ * @param stats Statistics
+ */
+void reap_report_children(const char* name, struct reap_stats* stats) {
+    fprintf(stderr, "%s: %" PRIu64 " reaped, %" PRIu64 " failed, %" PRIu64 " killed by signal\n",
+            name, stats->reaped, stats->failed, stats->signaled);
+    reap_report_usage(stats);
+}
+
+/**
+ * @brief Print summary of exit statuses and resource usage (stderr)
+ *
+ * Fork engine reports reaped atoms (and spawners, their usage includes atoms),
+ * other engines report usage of the whole process, because all atoms live in it.
+ *
+ * @param args Parsed command line arguments
+ */
+void reap_report(arguments_t args) {
+    if (args.engine == ENGINE_FORK) {
+        reap_report_children("atoms", &shared->atoms_reaped);
+        if (args.spawners > 0) {
+            reap_report_children("spawners", &shared->spawners_reaped);
+        }
+        return;
+    }
+
+    struct reap_stats stats = {0};
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    reap_stats_usage(&stats, &usage);
+    fprintf(stderr, "%s engine: usage of the whole process\n", engine_names[args.engine]);
+    reap_report_usage(&stats);
+}
+
+/**
+ * @brief End child process right away
+ *
+ * Lines of every log backend are in the file or in shared memory as soon
+ * as they are logged (no stdio buffers), and the kernel drops mappings and
+ * descriptors of the child anyway. Skipping exit() saves atexit handlers
+ * (shmdt) and close() calls, which add up over 10^5+ children.
+ *
+ * @param status Exit status
+ */
+__attribute__((noreturn)) void child_exit(int status) {
+    _exit(status);
+}
+
+/**
+ * @brief Spawner process, forks and reaps atoms with indexes in range
+ *
+ * Atoms die together with their spawner (PR_SET_PDEATHSIG), so the parent
+ * has to kill only spawners on failure.
+ *
+ * @param first First atom index (oxygens first, then hydrogens)
+ * @param last One past last atom index
+ * @param args Parsed command line arguments
+ */
+void spawner_process(unsigned long first, unsigned long last, arguments_t args) {
+    pid_t spawner = getpid();
+    reaper_t reaper;
+    reaper_init(&reaper);
+    for (unsigned long i = first; i < last; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != spawner) {
+                _exit(EXIT_FAILURE);
+            }
+            atom_run(i, args);
+            child_exit(0);
+        } else if (pid == -1) {
+            child_exit(EXIT_FAILURE);
+        }
+    }
+
+    // Reap all atoms of this spawner, publish their statistics to parent
+    struct reap_stats stats = {0};
+    reaper_wait(&reaper, last - first, &stats);
+    reaper_destroy(&reaper);
+    sync_mutex_lock(&shared->reaped_mutex);
+    reap_stats_merge(&shared->atoms_reaped, &stats);
+    sync_mutex_unlock(&shared->reaped_mutex);
+    child_exit(0);
+}
+
+/**
+ * @brief Run all atoms as child processes spawned by a tree of spawners
+ *
+ * Parent forks K spawners, each of them forks and reaps its own range of
+ * atoms, so spawning is not limited by fork() latency of a single process.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool run_fork_tree_engine(arguments_t args) {
+    unsigned long count = (unsigned long)args.no + args.nh;
+    uint32_t spawners = args.spawners < count ? args.spawners : count;
+    uint32_t spawned = 0;
+    bool success = true;
+
+    pid_t* pids = malloc(sizeof(pid_t) * spawners);
+    if (pids == NULL) {
+        fprintf(stderr, "Malloc error\n");
+        return false;
+    }
+
+    reaper_t reaper;
+    reaper_init(&reaper);
+    for (; spawned < spawners; spawned++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            free(pids);  // Cleanup in child
+            spawner_process(count * spawned / spawners, count * (spawned + 1) / spawners, args);
+        } else if (pid == -1) {
+            success = false;
+            break;
+        }
+        pids[spawned] = pid;
+    }
+
+    // Wait for spawners, kill all of them (and so all atoms) if any fails
+    struct reap_stats* stats = &shared->spawners_reaped;
+    while (success && stats->reaped < spawned) {
+        if (reaper_batch(&reaper, spawned - stats->reaped, stats) == 0) {
+            break;
+        }
+        success = stats->failed == 0 && stats->signaled == 0;
+    }
+    if (!success) {
+        fprintf(stderr, "Fork error\n");
+        for (uint32_t i = 0; i < spawned; i++) {
+            kill(pids[i], SIGKILL);
+        }
+        reaper_wait(&reaper, spawned - stats->reaped, stats);
+    }
+    reaper_destroy(&reaper);
+
+    free(pids);
+    return success;
+}
+
+/**
+ * Atom thread entry point
+ *
+ * @param arg Atom thread description (atom_thread_t)
+ * @return Always NULL
+ */
+void* atom_thread(void* arg) {
+    atom_thread_t* atom = arg;
+    atom_run(atom->index, *atom->args);
+    return NULL;
+}
+
+/**
+ * @brief Run all atoms as child processes
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool run_fork_engine(arguments_t args) {
+    // Counter of spawned processes
+    unsigned long spawned = 0;
+
+    // Children pid array
+    pid_t* pids = malloc(sizeof(pid_t) * ((size_t)args.no + args.nh));
+    if (pids == NULL) {
+        fprintf(stderr, "Malloc error\n");
+        return false;
+    }
+
+    reaper_t reaper;
+    reaper_init(&reaper);
+
+    // Spawn oxygen processes first, then hydrogen processes
+    for (unsigned long i = 0; i < (unsigned long)args.no + args.nh; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            free(pids);  // Cleanup in child
+            atom_run(i, args);
+            child_exit(0);
+        } else if (pid == -1) {
+            goto fork_error;
+        } else {
+            pids[spawned] = pid;
+        }
+        spawned++;
+    }
+
+    // Wait for all children to end
+    reaper_wait(&reaper, spawned, &shared->atoms_reaped);
+    reaper_destroy(&reaper);
+
+    free(pids);
+    if (shared->atoms_reaped.failed > 0 || shared->atoms_reaped.signaled > 0) {
+        fprintf(stderr, "Atom process failed\n");
+        return false;
+    }
+    return true;
+
+// Error handling section
+fork_error:
+    fprintf(stderr, "Fork error\n");
+
+    // Kill and reap all children
+    for (uint32_t i = 0; i < spawned; i++) {
+        kill(pids[i], SIGKILL);
+    }
+    reaper_wait(&reaper, spawned, &shared->atoms_reaped);
+    reaper_destroy(&reaper);
+    free(pids);
+    return false;
+}
+
+/**
+ * @brief Run all atoms as threads of this process
+ *
+ * Atoms share the same shared memory structure, semaphores are process-private.
+ * On thread creation failure the whole process is terminated, because threads
+ * already blocked on semaphores can't be cancelled safely.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool run_thread_engine(arguments_t args) {
+    unsigned long count = (unsigned long)args.no + args.nh;
+
+    atom_thread_t* atoms = malloc(sizeof(atom_thread_t) * count);
+    if (atoms == NULL) {
+        fprintf(stderr, "Malloc error\n");
+        return false;
+    }
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) || pthread_attr_setstacksize(&attr, ATOM_THREAD_STACK_SIZE)) {
+        fprintf(stderr, "Thread error\n");
+        free(atoms);
+        return false;
+    }
+
+    // Spawn oxygen threads first, then hydrogen threads (same order as fork engine)
+    for (unsigned long i = 0; i < count; i++) {
+        atoms[i].index = i;
+        atoms[i].args = &args;
+        if (pthread_create(&atoms[i].thread, &attr, atom_thread, &atoms[i])) {
+            fprintf(stderr, "Thread error\n");
+            close_metrics();
+            _exit(EXIT_FAILURE);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Wait for all threads to end
+    for (unsigned long i = 0; i < count; i++) {
+        pthread_join(atoms[i].thread, NULL);
+    }
+
+    free(atoms);
+    return true;
+}
+
+/**
+ * Push atom to queue
+ *
+ * @param queue Queue
+ * @param atom Atom index
+ */
+void atom_queue_push(atom_queue_t* queue, uint32_t atom) {
+    queue->items[(queue->head + queue->count) % queue->capacity] = atom;
+    queue->count++;
+}
+
+/**
+ * Pop atom from queue (queue must not be empty)
+ *
+ * @param queue Queue
+ * @return Atom index
+ */
+uint32_t atom_queue_pop(atom_queue_t* queue) {
+    uint32_t atom = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return atom;
+}
+
+/**
+ * Make atom runnable (pool mutex must be held)
+ *
+ * @param pool Pool
+ * @param atom Atom index
+ */
+void pool_ready(pool_t* pool, uint32_t atom) {
+    atom_queue_push(&pool->ready, atom);
+    pthread_cond_signal(&pool->cond);
+}
+
+/**
+ * Put atom to sleep, it becomes runnable after the time elapses (pool mutex must be held)
+ *
+ * @param pool Pool
+ * @param atom Atom index
+ * @param millis Number of milliseconds to sleep
+ */
+void pool_sleep(pool_t* pool, uint32_t atom, uint32_t millis) {
+    if (millis == 0 || bench.enabled) {
+        pool_ready(pool, atom);
+        return;
+    }
+
+    // Sift up
+    pool_timer_t timer = {.deadline = now_ns() + (uint64_t)millis * 1000000, .atom = atom};
+    uint32_t i = pool->timer_count++;
+    while (i > 0 && pool->timers[(i - 1) / 2].deadline > timer.deadline) {
+        pool->timers[i] = pool->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    pool->timers[i] = timer;
+
+    // Sleeping workers may need to wake up sooner
+    if (i == 0) {
+        pthread_cond_broadcast(&pool->cond);
+    }
+}
+
+/**
+ * Move all atoms with elapsed sleep to ready queue (pool mutex must be held)
+ *
+ * @param pool Pool
+ */
+void pool_expire_timers(pool_t* pool) {
+    uint64_t now = now_ns();
+    while (pool->timer_count > 0 && pool->timers[0].deadline <= now) {
+        atom_queue_push(&pool->ready, pool->timers[0].atom);
+
+        // Sift down
+        pool_timer_t last = pool->timers[--pool->timer_count];
+        uint32_t i = 0;
+        while (true) {
+            uint32_t child = i * 2 + 1;
+            if (child >= pool->timer_count) {
+                break;
+            }
+            if (child + 1 < pool->timer_count &&
+                pool->timers[child + 1].deadline < pool->timers[child].deadline) {
+                child++;
+            }
+            if (pool->timers[child].deadline >= last.deadline) {
+                break;
+            }
+            pool->timers[i] = pool->timers[child];
+            i = child;
+        }
+        pool->timers[i] = last;
+    }
+}
+
+/**
+ * Create molecule if there are enough waiting atoms (pool mutex must be held)
+ *
+ * Only one molecule is created at a time, same as in other engines
+ *
+ * @param pool Pool
+ */
+void pool_try_bond(pool_t* pool) {
+    if (pool->molecule_active || pool->oxygen_waiting.count < 1 ||
+        pool->hydrogen_waiting.count < 2) {
+        return;
+    }
+
+    pool->molecule_active = true;
+    pool->molecule_pending = 3;
+    pool->molecule_atoms[0] = atom_queue_pop(&pool->oxygen_waiting);
+    pool->molecule_atoms[1] = atom_queue_pop(&pool->hydrogen_waiting);
+    pool->molecule_atoms[2] = atom_queue_pop(&pool->hydrogen_waiting);
+    pool->molecule_start = bench_start();
+    reactor->molecule_count++;
+
+    for (int i = 0; i < 3; i++) {
+        pool_atom_t* atom = &pool->atoms[pool->molecule_atoms[i]];
+        atom->state = ATOM_CREATING;
+        trace_point(atom->oxygen, atom->id, TRACE_WOKEN);
+        pool_ready(pool, pool->molecule_atoms[i]);
+    }
+}
+
+/**
+ * Release all waiting atoms when no more molecules can be created (pool mutex must be held)
+ *
+ * @param pool Pool
+ */
+void pool_check_not_enough(pool_t* pool) {
+    if (reactor->molecule_count < pool->molecule_total || pool->molecule_active) {
+        return;
+    }
+
+    reactor->not_enough = true;
+    while (pool->oxygen_waiting.count > 0) {
+        uint32_t atom = atom_queue_pop(&pool->oxygen_waiting);
+        pool->atoms[atom].state = ATOM_NOT_ENOUGH;
+        pool_ready(pool, atom);
+    }
+    while (pool->hydrogen_waiting.count > 0) {
+        uint32_t atom = atom_queue_pop(&pool->hydrogen_waiting);
+        pool->atoms[atom].state = ATOM_NOT_ENOUGH;
+        pool_ready(pool, atom);
+    }
+}
+
+/**
+ * Mark atom as finished (pool mutex must be held)
+ *
+ * @param pool Pool
+ * @param atom Atom
+ */
+void pool_finish(pool_t* pool, pool_atom_t* atom) {
+    trace_point(atom->oxygen, atom->id, TRACE_EXIT);
+    bench_atom_end(*pool->args);
+    atom->state = ATOM_DONE;
+    pool->done_count++;
+    if (pool->done_count == pool->atom_count) {
+        pthread_cond_broadcast(&pool->cond);
+    }
+}
+
+/**
+ * @brief Advance atom to its next state
+ *
+ * Logging is done without holding the pool mutex, state transitions with it
+ *
+ * @param pool Pool
+ * @param index Atom index
+ */
+void pool_step(pool_t* pool, uint32_t index) {
+    pool_atom_t* atom = &pool->atoms[index];
+
+    switch (atom->state) {
+        case ATOM_START:
+            log_event(atom->oxygen, atom->id, EVENT_STARTED, 0);
+            pthread_mutex_lock(&pool->mutex);
+            atom->state = ATOM_QUEUE;
+            pool_sleep(pool, index, rand_millis(&atom->rng, pool->args->ti));
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        case ATOM_QUEUE:
+            log_event(atom->oxygen, atom->id, EVENT_QUEUE, 0);
+            pthread_mutex_lock(&pool->mutex);
+            if (reactor->not_enough) {
+                atom->state = ATOM_NOT_ENOUGH;
+                pool_ready(pool, index);
+            } else {
+                atom->state = ATOM_WAITING;
+                atom_queue_push(atom->oxygen ? &pool->oxygen_waiting : &pool->hydrogen_waiting,
+                                index);
+                pool_try_bond(pool);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        case ATOM_CREATING:
+            log_event(atom->oxygen, atom->id, EVENT_CREATING, reactor->molecule_count);
+            pthread_mutex_lock(&pool->mutex);
+            atom->state = ATOM_BUILDING;
+            if (--pool->molecule_pending == 0) {
+                // Oxygen builds the molecule, hydrogens are woken up after it
+                pool->molecule_pending = 3;
+                for (int i = 0; i < 3; i++) {
+                    pool->atoms[pool->molecule_atoms[i]].state = ATOM_CREATED;
+                }
+                uint32_t oxygen = pool->molecule_atoms[0];
+                pool_sleep(pool, oxygen, rand_millis(&pool->atoms[oxygen].rng, pool->args->tb));
+            }
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        case ATOM_CREATED:
+            log_event(atom->oxygen, atom->id, EVENT_CREATED, reactor->molecule_count);
+            pthread_mutex_lock(&pool->mutex);
+            if (index == pool->molecule_atoms[0]) {
+                pool_ready(pool, pool->molecule_atoms[1]);
+                pool_ready(pool, pool->molecule_atoms[2]);
+            }
+            pool_finish(pool, atom);
+            if (--pool->molecule_pending == 0) {
+                bench_molecule(pool->molecule_start);
+                pool->molecule_active = false;
+                pool_try_bond(pool);
+                pool_check_not_enough(pool);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        case ATOM_NOT_ENOUGH:
+            log_event(atom->oxygen, atom->id, EVENT_NOT_ENOUGH, 0);
+            pthread_mutex_lock(&pool->mutex);
+            pool_finish(pool, atom);
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Pool worker thread
+ *
+ * @param arg Pool (pool_t)
+ * @return Always NULL
+ */
+void* pool_worker(void* arg) {
+    pool_t* pool = arg;
+
+    reactor = &shared->reactors[0];
+    pthread_mutex_lock(&pool->mutex);
+    affinity_pin(pool->worker_count++);
+    while (pool->done_count < pool->atom_count) {
+        pool_expire_timers(pool);
+        if (pool->ready.count > 0) {
+            uint32_t index = atom_queue_pop(&pool->ready);
+            pthread_mutex_unlock(&pool->mutex);
+            pool_step(pool, index);
+            pthread_mutex_lock(&pool->mutex);
+        } else if (pool->timer_count > 0) {
+            uint64_t deadline = pool->timers[0].deadline;
+            struct timespec ts = {.tv_sec = deadline / 1000000000,
+                                  .tv_nsec = deadline % 1000000000};
+            pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts);
+        } else {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/**
+ * @brief Run all atoms on a fixed number of worker threads
+ *
+ * Every atom is a small state machine instead of a blocked stack, so memory
+ * use is O(workers + atoms).
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool run_pool_engine(arguments_t args) {
+    bool success = false;
+    pool_t pool = {.args = &args,
+                   .atom_count = args.no + args.nh,
+                   .molecule_total = molecule_total(args)};
+
+    pool.atoms = malloc(sizeof(pool_atom_t) * pool.atom_count);
+    pool.timers = malloc(sizeof(pool_timer_t) * pool.atom_count);
+    pool.ready = (atom_queue_t){.items = malloc(sizeof(uint32_t) * pool.atom_count),
+                                .capacity = pool.atom_count};
+    pool.oxygen_waiting =
+        (atom_queue_t){.items = malloc(sizeof(uint32_t) * args.no), .capacity = args.no};
+    pool.hydrogen_waiting =
+        (atom_queue_t){.items = malloc(sizeof(uint32_t) * args.nh), .capacity = args.nh};
+    pthread_t* workers = malloc(sizeof(pthread_t) * args.workers);
+    if (pool.atoms == NULL || pool.timers == NULL || pool.ready.items == NULL ||
+        pool.oxygen_waiting.items == NULL || pool.hydrogen_waiting.items == NULL ||
+        workers == NULL) {
+        fprintf(stderr, "Malloc error\n");
+        goto cleanup;
+    }
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    // All atoms start runnable (oxygens first, same order as fork engine)
+    for (uint32_t i = 0; i < pool.atom_count; i++) {
+        pool.atoms[i].oxygen = i < args.no;
+        pool.atoms[i].id = pool.atoms[i].oxygen ? i + 1 : i - args.no + 1;
+        pool.atoms[i].state = ATOM_START;
+        rng_seed(&pool.atoms[i].rng, args.seed, pool.atoms[i].id, pool.atoms[i].oxygen);
+        atom_queue_push(&pool.ready, i);
+    }
+
+    uint32_t started = 0;
+    for (; started < args.workers; started++) {
+        if (pthread_create(&workers[started], NULL, pool_worker, &pool)) {
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Thread error\n");
+    } else {
+        success = true;
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
+
+cleanup:
+    free(workers);
+    free(pool.hydrogen_waiting.items);
+    free(pool.oxygen_waiting.items);
+    free(pool.ready.items);
+    free(pool.timers);
+    free(pool.atoms);
+    return success;
+}
+
+/**
+ * Publish backlog and input pauses (live metrics, called with state mutex)
+ *
+ * @param state Engine state
+ */
+void stream_metrics(stream_state_t* state) {
+    if (live.block == NULL) {
+        return;
+    }
+    uint64_t backlog = state->arrived[true] - state->launched[true] + state->arrived[false] -
+                       state->launched[false];
+    __atomic_store_n(&live.block->backlog, backlog, __ATOMIC_RELAXED);
+    __atomic_store_n(&live.block->pauses, state->pauses, __ATOMIC_RELAXED);
+    __atomic_store_n(&live.block->paused_since, state->paused_since, __ATOMIC_RELAXED);
+    __atomic_store_n(&live.block->paused_ns, state->paused_ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Stream engine atom thread
+ *
+ * Thread runs atoms of its type one after another for as long as the stream
+ * is open, so threads and their stacks are recycled instead of one thread
+ * per atom. Atoms launched after the stream was drained are leftovers, each
+ * of them posts the token it will wake up with.
+ *
+ * @param arg Thread description (stream_slot_t)
+ * @return Always NULL
+ */
+void* stream_thread(void* arg) {
+    stream_slot_t* slot = arg;
+    stream_state_t* state = slot->state;
+    reactor = &shared->reactors[0];
+    affinity_pin(slot->index);
+
+    pthread_mutex_lock(&state->mutex);
+    while (true) {
+        if (state->launched[slot->oxygen] < state->arrived[slot->oxygen]) {
+            uint32_t id = ++state->launched[slot->oxygen];
+            stream_metrics(state);
+            if (state->draining) {
+                Sem queue = slot->oxygen ? SEM_OXYGEN_QUEUE : SEM_HYDROGEN_QUEUE;
+                sync_sem_post(&reactor->semaphores[queue].sem);
+            }
+            pthread_cond_broadcast(&state->change);
+            pthread_mutex_unlock(&state->mutex);
+            atom_process(slot->oxygen, id, state->args);
+            pthread_mutex_lock(&state->mutex);
+            state->finished++;
+            pthread_cond_broadcast(&state->change);
+        } else if (state->closed) {
+            break;
+        } else {
+            pthread_cond_wait(&state->launch, &state->mutex);
+        }
+    }
+    pthread_mutex_unlock(&state->mutex);
+    return NULL;
+}
+
+/**
+ * Stop stream on SIGINT or SIGTERM (interrupts blocking reads)
+ *
+ * @param sig Signal number
+ */
+void stream_stop_handler(int sig) {
+    (void)sig;
+    stream.stop = 1;
+}
+
+/**
+ * Get number of molecules atoms arrived so far can form
+ *
+ * @param state Engine state
+ * @return Number of molecules
+ */
+uint64_t stream_molecules(stream_state_t* state) {
+    return state->arrived[true] < state->arrived[false] / 2 ? state->arrived[true]
+                                                            : state->arrived[false] / 2;
+}
+
+/**
+ * @brief Add arrivals read from input and apply backpressure
+ *
+ * Every 'O' and 'H' is one atom, whitespace is ignored and any other byte
+ * is reported (the run fails at the end). Reading pauses while the backlog
+ * of atoms without a thread is over the limit, but only as long as the
+ * atoms already read can still form a molecule (otherwise the missing atoms
+ * may be right behind in the input).
+ *
+ * @param state Engine state
+ * @param data Input bytes
+ * @param length Number of bytes
+ */
+void stream_arrive(stream_state_t* state, const char* data, size_t length) {
+    uint64_t oxygens = 0, hydrogens = 0, invalid = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == 'O') {
+            oxygens++;
+        } else if (data[i] == 'H') {
+            hydrogens++;
+        } else if (data[i] != ' ' && data[i] != '\n' && data[i] != '\t' && data[i] != '\r') {
+            fprintf(stderr, "Invalid atom: %c\n", data[i]);
+            invalid++;
+        }
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    state->arrived[true] += oxygens;
+    state->arrived[false] += hydrogens;
+    state->invalid += invalid;
+    stream_metrics(state);
+    pthread_cond_broadcast(&state->launch);
+    while (!stream.stop) {
+        uint64_t backlog = state->arrived[true] - state->launched[true] + state->arrived[false] -
+                           state->launched[false];
+        if (backlog <= stream.backlog || stream_molecules(state) <= state->finished / 3) {
+            break;
+        }
+        if (state->paused_since == 0) {
+            state->paused_since = now_ns();
+            state->pauses++;
+            stream_metrics(state);
+        }
+        pthread_cond_wait(&state->change, &state->mutex);
+    }
+    if (state->paused_since != 0) {
+        state->paused_ns += now_ns() - state->paused_since;
+        state->paused_since = 0;
+        stream_metrics(state);
+    }
+    pthread_mutex_unlock(&state->mutex);
+}
+
+/**
+ * Read arrivals from file descriptor until end of file or stop
+ *
+ * @param state Engine state
+ * @param fd Input
+ */
+void stream_read(stream_state_t* state, int fd) {
+    char buffer[4096];
+    while (!stream.stop) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            return;
+        }
+        stream_arrive(state, buffer, length);
+    }
+}
+
+/**
+ * @brief Read arrivals from connections of Unix socket until stop
+ *
+ * Clients connect one after another, every connection is read to its end.
+ *
+ * @param state Engine state
+ * @return true if successful, false otherwise
+ */
+bool stream_listen(stream_state_t* state) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(stream.socket) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return false;
+    }
+    strcpy(address.sun_path, stream.socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(stream.socket);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(fd, 16) == -1) {
+        fprintf(stderr, "Could not listen on %s\n", stream.socket);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+
+    while (!stream.stop) {
+        int connection = accept(fd, NULL, NULL);
+        if (connection == -1 && errno == EINTR) {
+            continue;
+        }
+        if (connection == -1) {
+            fprintf(stderr, "Could not accept connection\n");
+            break;
+        }
+        stream_read(state, connection);
+        close(connection);
+    }
+    close(fd);
+    unlink(stream.socket);
+    return true;
+}
+
+/**
+ * @brief Run atoms arriving on stdin or Unix socket
+ *
+ * A fixed set of threads (slots oxygen and 2 * slots hydrogen threads) runs
+ * the atoms and arrivals are only counted, so memory doesn't grow with the
+ * number of atoms. Per-type thread counts make sure waiting atoms of one type
+ * never take the threads the other type needs. When input ends (or on SIGINT
+ * or SIGTERM), all molecules which can still be formed are finished first
+ * and then the leftovers are told there are not enough atoms.
+ *
+ * @param args Parsed command line arguments
+ * @return true if successful, false otherwise
+ */
+bool run_stream_engine(arguments_t args) {
+    uint32_t count = 3 * stream.slots;
+    stream_slot_t* slots = malloc(sizeof(stream_slot_t) * count);
+    if (slots == NULL) {
+        fprintf(stderr, "Malloc error\n");
+        return false;
+    }
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) || pthread_attr_setstacksize(&attr, ATOM_THREAD_STACK_SIZE)) {
+        fprintf(stderr, "Thread error\n");
+        free(slots);
+        return false;
+    }
+
+    stream_state_t state = {.args = args};
+    pthread_mutex_init(&state.mutex, NULL);
+    pthread_cond_init(&state.launch, NULL);
+    pthread_cond_init(&state.change, NULL);
+
+    // Stop signals interrupt the reader (main thread), never an atom thread
+    struct sigaction action = {.sa_handler = stream_stop_handler};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (uint32_t i = 0; i < count; i++) {
+        slots[i] = (stream_slot_t){.oxygen = i < stream.slots, .index = i, .state = &state};
+        if (pthread_create(&slots[i].thread, &attr, stream_thread, &slots[i])) {
+            fprintf(stderr, "Thread error\n");
+            close_metrics();
+            _exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attr);
+
+    bool success = true;
+    if (stream.socket != NULL) {
+        success = stream_listen(&state);
+    } else {
+        stream_read(&state, STDIN_FILENO);
+    }
+
+    // Finish all molecules which can be formed, then wake leftovers in queue
+    pthread_mutex_lock(&state.mutex);
+    uint64_t molecules = stream_molecules(&state);
+    while (state.finished < 3 * molecules) {
+        pthread_cond_wait(&state.change, &state.mutex);
+    }
+    reactor->not_enough = true;
+    state.draining = true;
+    sync_sem_post_n(&reactor->semaphores[SEM_OXYGEN_QUEUE].sem, state.launched[true] - molecules);
+    sync_sem_post_n(&reactor->semaphores[SEM_HYDROGEN_QUEUE].sem,
+                    state.launched[false] - 2 * molecules);
+    while (state.finished < state.arrived[true] + state.arrived[false]) {
+        pthread_cond_wait(&state.change, &state.mutex);
+    }
+    state.closed = true;
+    pthread_cond_broadcast(&state.launch);
+    pthread_mutex_unlock(&state.mutex);
+
+    for (uint32_t i = 0; i < count; i++) {
+        pthread_join(slots[i].thread, NULL);
+    }
+    free(slots);
+    if (state.pauses > 0) {
+        fprintf(stderr,
+                "Backpressure: input paused %" PRIu64 " times for %.1f ms in total "
+                "(backlog over %" PRIu64 " atoms)\n",
+                state.pauses, state.paused_ns / 1e6, stream.backlog);
+    }
+    if (state.invalid > 0) {
+        fprintf(stderr, "Input had %" PRIu64 " invalid atoms\n", state.invalid);
+        success = false;
+    }
+    pthread_cond_destroy(&state.change);
+    pthread_cond_destroy(&state.launch);
+    pthread_mutex_destroy(&state.mutex);
+    return success;
+}
+
 /**
- * Wait some time
- *
- * @param millis Maximum number of milliseconds to sleep
+ * Compare two durations (for qsort)
  */
-void wait_rand(uint32_t millis) {
-    uint32_t time = rand() % (millis + 1);
-    usleep(time * 1000);
+int compare_durations(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
 }
 
 /**
- * Initialize all semaphores
+ * Get percentile of sorted durations
  *
- * @return true if successful, false otherwise
+ * @param sorted Sorted durations
+ * @param count Number of durations
+ * @param percentile Percentile (0-100)
+ * @return Duration in microseconds
  */
-bool init_semaphores() {
-    // Initial semaphore values
-    unsigned int values[] = {
-        [SEM_OXYGEN_QUEUE] = 0,    [SEM_HYDROGEN_QUEUE] = 0, [SEM_TURNSTILE] = 0,
-        [SEM_TURNSTILE2] = 1,      [SEM_MUTEX] = 1,          [SEM_LOG_MUTEX] = 1,
-        [SEM_TURNSTILE_MUTEX] = 1, [SEM_MOLECULE_MUTEX] = 1};
-
-    for (int i = 0; i < SEM_COUNT; i++) {
-        if (sem_init(&shared->semaphores[i], 1, values[i])) {
-            return false;
-        }
+double percentile_us(uint64_t* sorted, size_t count, double percentile) {
+    if (count == 0) {
+        return 0;
     }
+    size_t index = (size_t)(percentile / 100 * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
 
-    return true;
+/**
+ * Get name of queue wait policy (for benchmark results)
+ *
+ * @return "block", "adaptive" or "spin"
+ */
+const char* queue_wait_name() {
+    return queue_wait.block ? "block" : queue_wait.fixed ? "spin" : "adaptive";
 }
 
 /**
- * Destroy all semaphores
+ * @brief Print benchmark results and append them to CSV output
+ *
+ * @param args Parsed command line arguments
+ * @param wall Wall time of the whole run in nanoseconds
+ * @param teardown Time from the end of the last atom to the end of teardown in nanoseconds
  */
-void destroy_semaphores() {
-    for (int i = 0; i < SEM_COUNT; i++) {
-        sem_destroy(&shared->semaphores[i]);
+void bench_report(arguments_t args, uint64_t wall, uint64_t teardown) {
+    double seconds = wall / 1e9;
+    uint32_t lines = shared->log_line_number - 1;
+    size_t count = bench.molecule_count;
+    if (bench.molecule_times != NULL) {
+        qsort(bench.molecule_times, count, sizeof(uint64_t), compare_durations);
+    }
+
+    double p50 = percentile_us(bench.molecule_times, count, 50);
+    double p90 = percentile_us(bench.molecule_times, count, 90);
+    double p99 = percentile_us(bench.molecule_times, count, 99);
+    double max = percentile_us(bench.molecule_times, count, 100);
+
+    printf("engine=%s sync=%s log=%s layout=%s affinity=%s reactors=%u wait=%s parallel=%d "
+           "NO=%u NH=%u\n",
+           engine_names[args.engine], SYNC_BACKEND, log_backend_names[log_backend], SHARED_LAYOUT,
+           affinity_names[affinity.policy], sharding.count, queue_wait_name(), args.parallel,
+           args.no, args.nh);
+    if (affinity.policy != AFFINITY_NONE && affinity.node == -1) {
+        printf("  placement:     %u cpus, first %u, segment not bound\n", affinity.count,
+               affinity.cpus[0]);
+    } else if (affinity.policy != AFFINITY_NONE) {
+        printf("  placement:     %u cpus, first %u, segment on node %d\n", affinity.count,
+               affinity.cpus[0], affinity.node);
+    }
+    printf("  wall time:     %.6f s\n", seconds);
+    printf("  teardown:      %.6f s\n", teardown / 1e9);
+    printf("  molecules/sec: %.0f\n", count / seconds);
+    printf("  lines/sec:     %.0f\n", lines / seconds);
+    printf("  molecule time: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", p50, p90, p99,
+           max);
+
+    if (bench.output == NULL) {
+        return;
+    }
+    FILE* csv = fopen(bench.output, "a");
+    if (csv == NULL) {
+        fprintf(stderr, "Could not open benchmark output %s\n", bench.output);
+        return;
     }
+    if (ftell(csv) == 0) {
+        fprintf(csv,
+                "engine,sync,log,layout,affinity,reactors,wait,parallel,no,nh,wall_s,teardown_s,"
+                "molecules,lines,molecules_per_s,lines_per_s,p50_us,p90_us,p99_us,max_us\n");
+    }
+    fprintf(csv, "%s,%s,%s,%s,%s,%u,%s,%d,%u,%u,%.6f,%.6f,%zu,%u,%.0f,%.0f,%.1f,%.1f,%.1f,%.1f\n",
+            engine_names[args.engine], SYNC_BACKEND, log_backend_names[log_backend],
+            SHARED_LAYOUT, affinity_names[affinity.policy], sharding.count, queue_wait_name(),
+            args.parallel, args.no, args.nh, seconds, teardown / 1e9, count, lines,
+            count / seconds, lines / seconds, p50, p90, p99, max);
+    fclose(csv);
 }
 
 /**
- * Detach from shared memory
+ * Write complete event of trace (skipped if any end was not reached)
+ *
+ * @param file Trace file
+ * @param name Event name
+ * @param tid Track of the atom
+ * @param from Start time
+ * @param to End time
+ * @param atom Lifecycle of the atom
  */
-void detach_shared() {
-    shmdt(shared);
+void trace_span(FILE* file, const char* name, uint64_t tid, uint64_t from, uint64_t to,
+                struct trace_atom* atom) {
+    if (from == 0 || to == 0 || to < from) {
+        return;
+    }
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu64
+            ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pid\":%d,\"molecule\":%u}}",
+            name, tid, (from - trace.start) / 1e3, (to - from) / 1e3, atom->pid, atom->molecule);
 }
 
 /**
- * Initialize shared memory
+ * @brief Write atom timeline in Chrome Trace Event format
+ *
+ * Every atom is one track of process "atoms" with its phases as complete
+ * events, every molecule is an async span of process "molecules" (from
+ * the first creating to the last created atom).
  *
+ * @param args Parsed command line arguments
  * @return true if successful, false otherwise
  */
-bool init_shared() {
-    shmid = shmget(IPC_PRIVATE, sizeof(struct s_shared), IPC_CREAT | 0666);
-    if (shmid == -1) {
+bool trace_write(arguments_t args) {
+    FILE* file = fopen(trace.output, "w");
+    if (file == NULL) {
         return false;
     }
 
-    shared = shmat(shmid, NULL, 0);
-    if (shared == (void*)-1) {
-        shmctl(shmid, IPC_RMID, NULL);
+    uint64_t count = (uint64_t)args.no + args.nh;
+    uint32_t molecules = molecule_total(args);
+    uint64_t* spans = calloc(2 * (uint64_t)molecules + 1, sizeof(uint64_t));
+    if (spans == NULL) {
+        fclose(file);
         return false;
     }
 
-    atexit(detach_shared);
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (int pid = 1; pid <= 2; pid++) {
+        fprintf(file,
+                "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                pid == 1 ? "" : ",\n", pid, pid == 1 ? "atoms" : "molecules");
+    }
 
-    shared->log_line_number = 1;
-    shared->hydrogen_count = 0;
-    shared->oxygen_count = 0;
-    shared->molecule_count = 0;
-    shared->oxygen_processed = 0;
-    shared->hydrogen_processed = 0;
-    shared->turnstile_count = 0;
-    shared->not_enough = false;
+    for (uint64_t i = 0; i < count; i++) {
+        struct trace_atom* atom = &trace.atoms[i];
+        uint64_t* time = atom->time;
+        bool oxygen = i < args.no;
+        fprintf(file,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu64
+                ",\"args\":{\"name\":\"%c %" PRIu64 "\"}}",
+                i + 1, oxygen ? 'O' : 'H', oxygen ? i + 1 : i - args.no + 1);
 
-    return true;
-}
+        uint64_t dequeued = time[TRACE_WOKEN]         ? time[TRACE_WOKEN]
+                            : time[TRACE_NOT_ENOUGH] ? time[TRACE_NOT_ENOUGH]
+                                                     : time[TRACE_EXIT];
+        trace_span(file, "init", i + 1, time[TRACE_STARTED], time[TRACE_QUEUE], atom);
+        trace_span(file, "queue", i + 1, time[TRACE_QUEUE], dequeued, atom);
+        trace_span(file, "bond", i + 1, time[TRACE_WOKEN], time[TRACE_CREATING], atom);
+        trace_span(file, "creating", i + 1, time[TRACE_CREATING], time[TRACE_CREATED], atom);
+        trace_span(file, "created", i + 1, time[TRACE_CREATED], time[TRACE_EXIT], atom);
+        trace_span(file, "not enough", i + 1, time[TRACE_NOT_ENOUGH], time[TRACE_EXIT], atom);
 
-/**
- * Destroy shared memory
- */
-void destroy_shared() {
-    shmctl(shmid, IPC_RMID, NULL);
+        // Molecule spans from the first creating to the last created atom
+        if (atom->molecule > 0 && atom->molecule <= molecules && time[TRACE_CREATED] != 0) {
+            uint64_t* span = &spans[2 * (atom->molecule - 1)];
+            if (span[0] == 0 || time[TRACE_CREATING] < span[0]) {
+                span[0] = time[TRACE_CREATING];
+            }
+            if (time[TRACE_CREATED] > span[1]) {
+                span[1] = time[TRACE_CREATED];
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < molecules; i++) {
+        uint64_t* span = &spans[2 * i];
+        if (span[0] == 0 || span[1] < span[0]) {
+            continue;
+        }
+        for (int end = 0; end < 2; end++) {
+            fprintf(file,
+                    ",\n{\"name\":\"molecule %u\",\"cat\":\"molecule\",\"ph\":\"%c\",\"id\":%u,"
+                    "\"pid\":2,\"tid\":1,\"ts\":%.3f}",
+                    i + 1, end ? 'e' : 'b', i + 1, (span[end] - trace.start) / 1e3);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    free(spans);
+    return fclose(file) == 0;
 }
 
 /**
- * Open log file
+ * @brief Read live metrics
  *
- * @return true if successful, false otherwise
+ * Counters are relaxed, later events of atom lifecycle are read first, so
+ * an atom which left the queue is never missing from its arrivals.
+ *
+ * @param block Mapped metrics
+ * @param sample Reading
  */
-bool open_log() {
-    shared->log_stream = fopen("proj2.out", "w");
-    return shared->log_stream != NULL;
+void metrics_read(struct metrics* block, struct metrics_sample* sample) {
+    memset(sample, 0, sizeof(*sample));
+    uint64_t finish = __atomic_load_n(&block->finish, __ATOMIC_ACQUIRE);
+    sample->time = finish != 0 ? finish : now_ns();
+    sample->finished = finish != 0;
+    uint64_t created = 0;
+    for (uint32_t i = 0; i < block->kind_count; i++) {
+        uint64_t events[EVENT_COUNT];
+        for (int event = EVENT_COUNT - 1; event >= 0; event--) {
+            events[event] = __atomic_load_n(&block->types[i].events[event], __ATOMIC_RELAXED);
+            sample->lines += events[event];
+        }
+        uint64_t left = events[EVENT_CREATING] + events[EVENT_NOT_ENOUGH];
+        sample->queued[i] = events[EVENT_QUEUE] > left ? events[EVENT_QUEUE] - left : 0;
+        created += events[EVENT_CREATED];
+        sample->leftovers += events[EVENT_NOT_ENOUGH];
+    }
+    sample->molecules = created / block->parties;
+    sample->waits = __atomic_load_n(&block->waits, __ATOMIC_RELAXED);
+    sample->wait_ns = __atomic_load_n(&block->wait_ns, __ATOMIC_RELAXED);
+    sample->backlog = __atomic_load_n(&block->backlog, __ATOMIC_RELAXED);
+    sample->pauses = __atomic_load_n(&block->pauses, __ATOMIC_RELAXED);
+    uint64_t since = __atomic_load_n(&block->paused_since, __ATOMIC_RELAXED);
+    sample->paused_ns = __atomic_load_n(&block->paused_ns, __ATOMIC_RELAXED);
+    if (since != 0 && since < sample->time) {
+        sample->paused_ns += sample->time - since;
+    }
 }
 
 /**
- * Close log file
+ * Print one line of live metrics (stdout)
+ *
+ * @param block Mapped metrics
+ * @param now Current reading
+ * @param last Reading rates and average wait are computed from
+ * @param total Print totals of the whole run instead of elapsed time
  */
-void close_log() {
-    fclose(shared->log_stream);
+void metrics_print(struct metrics* block, struct metrics_sample* now,
+                   struct metrics_sample* last, bool total) {
+    double seconds = (now->time - last->time) / 1e9;
+    seconds = seconds > 0 ? seconds : 1e-9;
+    uint64_t waits = now->waits - last->waits;
+    uint64_t paused_ns = now->paused_ns > last->paused_ns ? now->paused_ns - last->paused_ns : 0;
+    if (total) {
+        printf("total %.2f s:", (now->time - block->start) / 1e9);
+    } else {
+        printf("%8.2f s:", (now->time - block->start) / 1e9);
+    }
+    for (uint32_t i = 0; i < block->kind_count && !total; i++) {
+        printf(" %c queue %" PRIu64 ",", block->kinds[i], now->queued[i]);
+    }
+    if (block->stream && !total) {
+        printf(" backlog %" PRIu64 ",", now->backlog);
+    }
+    if (block->stream) {
+        printf(" paused %.1f ms (%" PRIu64 "),", paused_ns / 1e6, now->pauses - last->pauses);
+    }
+    printf(" molecules %" PRIu64, now->molecules);
+    if (block->molecules > 0) {
+        printf("/%u", block->molecules);
+    }
+    printf(" (%.0f/s), lines %" PRIu64 " (%.0f/s), wait %.1f us (%" PRIu64 "), leftovers %" PRIu64
+           "\n",
+           (now->molecules - last->molecules) / seconds, now->lines,
+           (now->lines - last->lines) / seconds,
+           waits > 0 ? (now->wait_ns - last->wait_ns) / 1e3 / waits : 0.0, waits, now->leftovers);
+    fflush(stdout);
 }
 
 /**
- * Logging function (fprintf wrapper) - thread/process safe
+ * @brief Attach to live metrics of running proj2 and print them (--stats=PID)
+ *
+ * One line is printed every interval until the run ends, then totals of the
+ * whole run follow.
+ *
+ * @return Exit status
  */
-void flog(const char* fmt, ...) {
-    sem_wait(&shared->semaphores[SEM_LOG_MUTEX]);
-
-    va_list arg;
-    va_start(arg, fmt);
-    fprintf(shared->log_stream, "%d: ", shared->log_line_number);
-    vfprintf(shared->log_stream, fmt, arg);
-    va_end(arg);
-    fflush(shared->log_stream);
-
-    shared->log_line_number++;
+int stats_attach() {
+    char name[32];
+    snprintf(name, sizeof(name), "/proj2-metrics-%d", (int)live.attach);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "No metrics of process %d (is it running with --metrics?)\n",
+                (int)live.attach);
+        return 1;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct metrics)) {
+        map = mmap(NULL, sizeof(struct metrics), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    struct metrics* block = map;
+    if (map == MAP_FAILED || __atomic_load_n(&block->ready, __ATOMIC_ACQUIRE) != METRICS_VERSION ||
+        memcmp(block->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) ||
+        block->size != sizeof(struct metrics) || block->kind_count == 0 ||
+        block->kind_count > LOG_MAX_KINDS || block->parties == 0) {
+        fprintf(stderr, "Invalid metrics of process %d\n", (int)live.attach);
+        if (map != MAP_FAILED) {
+            munmap(map, sizeof(struct metrics));
+        }
+        return 1;
+    }
 
-    sem_post(&shared->semaphores[SEM_LOG_MUTEX]);
+    struct timespec pause = {.tv_sec = live.interval / 1000,
+                             .tv_nsec = live.interval % 1000 * 1000000L};
+    struct metrics_sample first = {.time = block->start};
+    struct metrics_sample last = first;
+    int result = 0;
+    while (true) {
+        nanosleep(&pause, NULL);
+        struct metrics_sample now;
+        metrics_read(block, &now);
+        metrics_print(block, &now, &last, false);
+        if (now.finished) {
+            metrics_print(block, &now, &first, true);
+            break;
+        }
+        if (kill(live.attach, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "Process %d ended before its run finished\n", (int)live.attach);
+            result = 1;
+            break;
+        }
+        last = now;
+    }
+    munmap(map, sizeof(struct metrics));
+    return result;
 }
 
 /**
- * @brief Parse number from string
- *
- * Exits program if number is not valid
+ * Read unsigned number from sysfs, procfs or cgroup file
  *
- * @param str The string to be parsed
- * @param min Minimum valid value
- * @param max Maximum valid value
- * @return Parsed number
+ * @param path Path of file
+ * @return Number, UINT64_MAX if the file is missing or holds "max"
  */
-unsigned long parse_argument(char* str, size_t min, size_t max) {
-    char* end;
-    unsigned long number = strtoul(str, &end, 10);
-    if (end == str || *end != '\0' || number > max || number < min) {
-        fprintf(stderr, "Invalid argument: %s\n", str);
-        exit(EXIT_FAILURE);
+uint64_t read_sysfs_u64(const char* path) {
+    FILE* file = fopen(path, "r");
+    uint64_t number = UINT64_MAX;
+    if (file != NULL) {
+        if (fscanf(file, "%" SCNu64, &number) != 1) {
+            number = UINT64_MAX;
+        }
+        fclose(file);
     }
     return number;
 }
 
 /**
- * @brief Reusable barrier
+ * @brief Get what is left under limit of cgroup v2 the process is in
  *
- * Implemented from Little book of semaphores
- * 3.7.5
+ * @param limit Limit file (pids.max, memory.max)
+ * @param usage Usage file (pids.current, memory.current)
+ * @return Limit minus usage, UINT64_MAX if there is no limit
  */
-void barrier() {
-    sem_wait(&shared->semaphores[SEM_TURNSTILE_MUTEX]);
-    shared->turnstile_count++;
-    if (shared->turnstile_count == 3) {
-        sem_wait(&shared->semaphores[SEM_TURNSTILE2]);
-        sem_post(&shared->semaphores[SEM_TURNSTILE]);
+uint64_t plan_cgroup_left(const char* limit, const char* usage) {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return UINT64_MAX;
+    }
+    char line[PATH_MAX];
+    char path[PATH_MAX + 32] = "";
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/", line + 3);
+            break;
+        }
+    }
+    fclose(file);
+    if (path[0] == '\0' || strlen(path) + 16 > sizeof(path)) {
+        return UINT64_MAX;
     }
-    sem_post(&shared->semaphores[SEM_TURNSTILE_MUTEX]);
-    sem_wait(&shared->semaphores[SEM_TURNSTILE]);
-    sem_post(&shared->semaphores[SEM_TURNSTILE]);
-    sem_wait(&shared->semaphores[SEM_TURNSTILE_MUTEX]);
-    shared->turnstile_count--;
-    if (shared->turnstile_count == 0) {
-        sem_wait(&shared->semaphores[SEM_TURNSTILE]);
-        sem_post(&shared->semaphores[SEM_TURNSTILE2]);
+
+    size_t length = strlen(path);
+    strcpy(path + length, limit);
+    uint64_t max = read_sysfs_u64(path);
+    strcpy(path + length, usage);
+    uint64_t current = read_sysfs_u64(path);
+    if (max == UINT64_MAX || current == UINT64_MAX) {
+        return UINT64_MAX;
     }
-    sem_post(&shared->semaphores[SEM_TURNSTILE_MUTEX]);
-    sem_wait(&shared->semaphores[SEM_TURNSTILE2]);
-    sem_post(&shared->semaphores[SEM_TURNSTILE2]);
+    return max > current ? max - current : 0;
 }
 
 /**
- * @brief Oxygen child process
- *
- * Inspired by Little book of semaphores
- * 5.6.2
+ * Get what is left under task limit once the margin is kept free
  *
- * @param id Oxygen process id
- * @param args Parsed command line arguments
+ * @param limit Limit (UINT64_MAX for none)
+ * @param used Tasks counted against the limit
+ * @return Tasks the run may start, UINT64_MAX if there is no limit
  */
-void oxygen_process(uint32_t id, arguments_t args) {
-    // Seed random generator
-    srand(time(NULL) + id * 100 + getpid());
-
-    // Init
-    flog("O %d: started\n", id);
-    wait_rand(args.ti);
-    flog("O %d: going to queue\n", id);
-
-    // Wait in queue
-    sem_wait(&shared->semaphores[SEM_MUTEX]);
-    shared->oxygen_count++;
-    if (shared->hydrogen_count >= 2) {
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        shared->hydrogen_count -= 2;
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-        shared->oxygen_count--;
-    } else {
-        sem_post(&shared->semaphores[SEM_MUTEX]);
+uint64_t plan_tasks_left(uint64_t limit, uint64_t used) {
+    if (limit == UINT64_MAX) {
+        return UINT64_MAX;
     }
-    sem_wait(&shared->semaphores[SEM_OXYGEN_QUEUE]);
+    return limit > used + PLAN_TASK_MARGIN ? limit - used - PLAN_TASK_MARGIN : 0;
+}
 
-    // Look if there is enough hydrogen
-    if (shared->not_enough) {
-        flog("O %d: not enough H\n", id);
-        sem_post(&shared->semaphores[SEM_MUTEX]);
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        close_log();
-        exit(0);
+/**
+ * @brief Count tasks (processes and threads) of real user of this process
+ *
+ * Walks /proc once, RLIMIT_NPROC is checked against this count.
+ *
+ * @return Number of tasks
+ */
+uint64_t plan_user_tasks() {
+    DIR* proc = opendir("/proc");
+    if (proc == NULL) {
+        return 0;
+    }
+    uid_t uid = getuid();
+    uint64_t tasks = 0;
+    struct dirent* entry;
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%.32s/status", entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        char line[128];
+        unsigned long real = ULONG_MAX;
+        uint64_t threads = 0;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "Uid: %lu", &real) == 1 && real != uid) {
+                break;
+            }
+            if (sscanf(line, "Threads: %" SCNu64, &threads) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+        tasks += real == uid ? threads : 0;
     }
+    closedir(proc);
+    return tasks;
+}
 
-    // Update counts
-    sem_wait(&shared->semaphores[SEM_MOLECULE_MUTEX]);
-    shared->molecule_count++;
-    shared->oxygen_processed++;
-    sem_post(&shared->semaphores[SEM_MOLECULE_MUTEX]);
+/**
+ * Read task and memory limits of the machine into the plan
+ */
+void plan_limits() {
+    struct rlimit limit;
+    plan.nproc = UINT64_MAX;
+    if (getuid() != 0 && getrlimit(RLIMIT_NPROC, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        plan.nproc = limit.rlim_cur;
+    }
+    plan.cgroup_tasks = plan_cgroup_left("pids.max", "pids.current");
+    plan.pid_max = read_sysfs_u64("/proc/sys/kernel/pid_max");
+    plan.threads_max = read_sysfs_u64("/proc/sys/kernel/threads-max");
 
-    // Synchronize
-    barrier();
+    // Fourth field of loadavg is "runnable/total" tasks of the system, they all
+    // take pids and threads, RLIMIT_NPROC counts only tasks of the user
+    plan.running = 0;
+    FILE* file = fopen("/proc/loadavg", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%*s %*s %*s %*u/%" SCNu64, &plan.running) != 1) {
+            plan.running = 0;
+        }
+        fclose(file);
+    }
+    plan.user_tasks = plan.nproc != UINT64_MAX ? plan_user_tasks() : 0;
+    const uint64_t left[] = {
+        plan_tasks_left(plan.nproc, plan.user_tasks),
+        plan_tasks_left(plan.pid_max, plan.running),
+        plan_tasks_left(plan.threads_max, plan.running),
+        plan_tasks_left(plan.cgroup_tasks, 0),
+    };
+    plan.tasks_free = UINT64_MAX;
+    for (uint32_t i = 0; i < sizeof(left) / sizeof(left[0]); i++) {
+        plan.tasks_free = left[i] < plan.tasks_free ? left[i] : plan.tasks_free;
+    }
 
-    // Init molecule creation
-    flog("O %d: creating molecule %d\n", id, shared->molecule_count);
+    plan.memory_free = UINT64_MAX;
+    file = fopen("/proc/meminfo", "r");
+    if (file != NULL) {
+        char line[128];
+        uint64_t kb;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "MemAvailable: %" SCNu64 " kB", &kb) == 1) {
+                plan.memory_free = kb * 1024;
+                break;
+            }
+        }
+        fclose(file);
+    }
+    uint64_t memory = plan_cgroup_left("memory.max", "memory.current");
+    plan.memory_free = memory < plan.memory_free ? memory : plan.memory_free;
+}
 
-    // Create molecule (by waiting)
-    wait_rand(args.tb);
+/**
+ * @brief Estimate tasks alive at once and memory of engine
+ *
+ * Fork engine keeps every atom process (or its zombie) until all atoms are
+ * spawned, threads engine may have all atoms sleeping at once, pool engine
+ * needs only its workers and a few words per atom.
+ *
+ * @param args Parsed command line arguments (engine included)
+ */
+void plan_estimate(arguments_t args) {
+    uint64_t atoms = (uint64_t)args.no + args.nh;
+    plan.segment = shared_layout(args).size;
+    if (stream.enabled) {
+        plan.tasks = 3 * (uint64_t)stream.slots + 1;
+        plan.memory = plan.tasks * PLAN_THREAD_BYTES;
+    } else if (ENGINE(args) == ENGINE_FORK) {
+        plan.tasks = atoms + args.spawners + 1;
+        plan.memory = (atoms + args.spawners) * PLAN_PROCESS_BYTES + atoms * sizeof(pid_t);
+    } else if (ENGINE(args) == ENGINE_THREADS) {
+        plan.tasks = atoms + 1;
+        plan.memory = atoms * (PLAN_THREAD_BYTES + sizeof(atom_thread_t));
+    } else {
+        plan.tasks = (uint64_t)args.workers + 1;
+        plan.memory = args.workers * PLAN_THREAD_BYTES +
+                      atoms * (sizeof(pool_atom_t) + sizeof(pool_timer_t) + 3 * sizeof(uint32_t));
+    }
+    plan.memory += plan.segment;
+}
 
-    // Synchronize
-    barrier();
-    flog("O %d: molecule %d created\n", id, shared->molecule_count);
+/**
+ * Check if estimated run of engine fits limits of the machine
+ *
+ * @param args Parsed command line arguments (engine included)
+ * @return true if it fits
+ */
+bool plan_fits(arguments_t args) {
+    plan_estimate(args);
+    return plan.tasks <= plan.tasks_free && plan.memory <= plan.memory_free;
+}
 
-    // Signalize if we don't have enough atoms
-    if (args.no - shared->oxygen_processed >= 1 && args.nh - shared->hydrogen_processed < 2) {
-        shared->not_enough = true;
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-    } else if (args.no - shared->oxygen_processed == 0 &&
-               args.nh - shared->hydrogen_processed > 0) {
-        shared->not_enough = true;
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
+/**
+ * @brief Plan the run before anything is started
+ *
+ * Explicit engine is only checked, --engine=auto takes the first of fork,
+ * threads and pool engine which fits and supports the other options.
+ *
+ * @param args Parsed command line arguments, engine is set with --engine=auto
+ * @return true if the run fits, false otherwise (error is printed)
+ */
+bool plan_run(arguments_t* args) {
+    plan_limits();
+    if (plan.auto_engine && !stream.enabled) {
+        bool pool = !args->parallel && !recipe.generic && sharding.count == 1 &&
+                    replay.record == NULL && replay.replay == NULL;
+        const engine_t engines[] = {ENGINE_FORK, ENGINE_THREADS, ENGINE_POOL};
+        for (uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+            if (engines[i] == ENGINE_POOL && !pool) {
+                continue;
+            }
+#ifdef PROJ2_ENGINE
+            if (engines[i] != ENGINE(*args)) {
+                continue;
+            }
+#endif
+            args->engine = engines[i];
+            if (plan_fits(*args)) {
+                return true;
+            }
+        }
+    } else if (plan_fits(*args)) {
+        return true;
     }
 
-    // Synchronize
-    barrier();
-
-    // Finish
-    sem_post(&shared->semaphores[SEM_MUTEX]);
-    close_log();
-    exit(0);
+    fprintf(stderr,
+            "%s %s: %" PRIu64 " tasks and %" PRIu64 " MiB needed, %" PRIu64 " tasks and %" PRIu64
+            " MiB available%s\n",
+            plan.auto_engine ? "No engine fits, last tried" : "Engine does not fit,",
+            engine_names[args->engine], plan.tasks, plan.memory >> 20, plan.tasks_free,
+            plan.memory_free >> 20, plan.auto_engine ? "" : " (try --engine=auto)");
+    return false;
 }
 
 /**
- * @brief Hydrogen child process
+ * Print plan of the run (--plan, stdout)
  *
- * Inspired by Little book of semaphores
- * 5.6.2
- *
- * @param id Oxygen process id
  * @param args Parsed command line arguments
+ * @param fits Run fits limits of the machine
  */
-void hydrogen_process(uint32_t id, arguments_t args) {
-    // Seed random generator
-    srand(time(NULL) + id * 100 + getpid());
-
-    // Init
-    flog("H %d: started\n", id);
-    wait_rand(args.ti);
-    flog("H %d: going to queue\n", id);
+void plan_print(arguments_t args, bool fits) {
+    const uint64_t values[] = {plan.nproc,   plan.cgroup_tasks, plan.pid_max,     plan.threads_max,
+                               plan.running, plan.tasks_free,   plan.memory_free};
+    char texts[7][24];
+    for (uint32_t i = 0; i < 7; i++) {
+        uint64_t value = i == 6 && values[i] != UINT64_MAX ? values[i] >> 20 : values[i];
+        if (value == UINT64_MAX) {
+            snprintf(texts[i], sizeof(texts[i]), "none");
+        } else {
+            snprintf(texts[i], sizeof(texts[i]), "%" PRIu64, value);
+        }
+    }
+    printf("engine:  %s%s, %s\n", stream.enabled ? "stream" : engine_names[args.engine],
+           plan.auto_engine ? " (auto)" : "", fits ? "fits" : "does not fit");
+    printf("atoms:   %" PRIu64 ", %u molecules\n", (uint64_t)args.no + args.nh,
+           molecule_total(args));
+    printf("tasks:   %" PRIu64 " needed, %s free (RLIMIT_NPROC %s, user tasks %" PRIu64
+           ", cgroup %s, pid_max %s, threads-max %s, running %s)\n",
+           plan.tasks, texts[5], texts[0], plan.user_tasks, texts[1], texts[2], texts[3],
+           texts[4]);
+    printf("memory:  %" PRIu64 " MiB needed (segment %" PRIu64 " MiB), %s MiB free\n",
+           plan.memory >> 20, plan.segment >> 20, texts[6]);
+}
 
-    // Wait in queue
-    sem_wait(&shared->semaphores[SEM_MUTEX]);
-    shared->hydrogen_count++;
-    if (shared->hydrogen_count >= 2 && shared->oxygen_count >= 1) {
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        shared->hydrogen_count -= 2;
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-        shared->oxygen_count--;
-    } else {
-        sem_post(&shared->semaphores[SEM_MUTEX]);
+/**
+ * Main parent process
+ */
+int main(int argc, char* argv[]) {
+    // Split options and positional arguments
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    arguments_t args = {.engine = ENGINE_DEFAULT, .workers = cores > 0 ? cores : 1};
+    char* positional[RECIPE_MAX_TYPES + 2];
+    uint32_t positional_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            parse_option(argv[i], &args);
+        } else if (positional_count < RECIPE_MAX_TYPES + 2) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count++;
+            break;
+        }
     }
-    sem_wait(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
 
-    // Look if there is enough O and H
-    if (shared->not_enough) {
-        flog("H %d: not enough O or H\n", id);
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-        close_log();
-        exit(0);
+    // Attach tool needs no run
+    if (live.attach != 0) {
+        if (positional_count != 0) {
+            fprintf(stderr, "--stats takes no positional arguments\n");
+            return 1;
+        }
+        return stats_attach();
     }
 
-    // Update counts
-    sem_wait(&shared->semaphores[SEM_MOLECULE_MUTEX]);
-    shared->hydrogen_processed++;
-    sem_post(&shared->semaphores[SEM_MOLECULE_MUTEX]);
+    // Engine and log backend may be fixed at build time
+#ifdef PROJ2_LOG
+    if (log_option != log_backend) {
+        fprintf(stderr, "Built with %s log only\n", log_backend_names[log_backend]);
+        return 1;
+    }
+#else
+    log_backend = log_option;
+#endif
+#ifdef PROJ2_ENGINE
+    if (args.engine != ENGINE(args) || (stream.enabled && ENGINE(args) != ENGINE_THREADS)) {
+        fprintf(stderr, "Built with %s engine only\n", engine_names[ENGINE(args)]);
+        return 1;
+    }
+#endif
 
-    // Synchronize
-    barrier();
+    // Check number of arguments (count of every atom type, TI and TB; TI and TB for stream)
+    uint32_t counts = stream.enabled ? 0 : recipe.types;
+    if (positional_count != counts + 2) {
+        fprintf(stderr, "Invalid number of arguments!\n");
+        return 1;
+    }
 
-    // Init molecule creation
-    flog("H %d: creating molecule %d\n", id, shared->molecule_count);
+    if (args.parallel && args.engine == ENGINE_POOL) {
+        fprintf(stderr, "Parallel molecules are not supported by pool engine\n");
+        return 1;
+    }
 
-    // Synchronize
-    barrier();
-    flog("H %d: molecule %d created\n", id, shared->molecule_count);
+    if (recipe.generic && (args.engine == ENGINE_POOL || args.parallel || trace.output != NULL)) {
+        fprintf(stderr, "Recipe is not supported by pool engine, parallel molecules and trace\n");
+        return 1;
+    }
 
-    // Synchronize
-    barrier();
+    if (stream.enabled && (args.engine == ENGINE_POOL || args.parallel || recipe.generic ||
+                           trace.output != NULL || bench.enabled || log_backend == LOG_BINARY ||
+                           log_backend == LOG_MMAP)) {
+        fprintf(stderr, "Stream mode supports only H2O atom threads with stdio or ring log\n");
+        return 1;
+    }
+    if (stream.enabled) {
+        args.engine = ENGINE_THREADS;
+    }
 
-    // Finish
-    close_log();
-    exit(0);
-}
+    if (sharding.count > 1 && (args.engine == ENGINE_POOL || args.parallel || recipe.generic ||
+                               stream.enabled || trace.output != NULL)) {
+        fprintf(stderr, "Reactors are supported only by H2O fork and thread engines\n");
+        return 1;
+    }
 
-/**
- * Main parent process
- */
-int main(int argc, char* argv[]) {
-    // Check number of arguments
-    if (argc != 5) {
-        fprintf(stderr, "Invalid number of arguments!\n");
+    if ((replay.record != NULL || replay.replay != NULL) &&
+        ((replay.record != NULL && replay.replay != NULL) || args.engine == ENGINE_POOL ||
+         args.parallel || recipe.generic || stream.enabled || sharding.count > 1)) {
+        fprintf(stderr, "Record or replay is supported only by single reactor H2O fork and "
+                        "thread engines\n");
         return 1;
     }
 
+    // Spinning can't see a partner which has no CPU to run on
+    if (queue_wait.spin_max == UINT32_MAX) {
+        queue_wait.spin_max = cores > 1 ? QUEUE_SPIN_MAX : 0;
+    }
+    if (!queue_wait.fixed && queue_wait.spins > queue_wait.spin_max) {
+        queue_wait.spins = queue_wait.spin_max;
+    }
+
+    // Runs without explicit seed differ
+    if (!args.seeded) {
+        args.seed = (uint64_t)time(NULL) << 32 ^ getpid();
+    }
+
     // Parse arguments
-    arguments_t args = {.no = parse_argument(argv[1], 1, LONG_MAX),
-                        .nh = parse_argument(argv[2], 1, LONG_MAX),
-                        .ti = parse_argument(argv[3], 0, 1000),
-                        .tb = parse_argument(argv[4], 0, 1000)};
+    uint64_t atoms = 0;
+    for (uint32_t i = 0; i < counts; i++) {
+        recipe.atoms[i] = parse_argument(positional[i], 1, UINT32_MAX);
+        atoms += recipe.atoms[i];
+    }
+    if (atoms > UINT32_MAX) {
+        fprintf(stderr, "Too many atoms\n");
+        return 1;
+    }
+    args.no = recipe.atoms[0];
+    args.nh = atoms - recipe.atoms[0];
+    args.ti = parse_argument(positional[counts], 0, 1000);
+    args.tb = parse_argument(positional[counts + 1], 0, 1000);
+
+    // Check the run fits limits of the machine before anything is started
+    bool fits = plan_run(&args);
+    if (plan.print) {
+        plan_print(args, fits);
+        return fits ? 0 : 1;
+    }
+    if (!fits) {
+        return 1;
+    }
 
     // Initialize
-    if (!init_shared()) {
+    if (!init_affinity(args)) {
+        fprintf(stderr, "Could not initialize CPU affinity\n");
+        return 1;
+    }
+    if (!open_replay(args)) {
+        return 1;
+    }
+    if (!init_metrics(args)) {
+        fprintf(stderr, "Could not create live metrics\n");
+        close_replay();
+        return 1;
+    }
+    if (!init_shared(args)) {
         fprintf(stderr, "Could not initialize shared memory\n");
         goto shared_error;
     }
-    if (!open_log()) {
+    if (!open_log(args)) {
         fprintf(stderr, "Could not open log file\n");
         goto log_error;
     }
-    if (!init_semaphores()) {
+    if (!init_semaphores(ENGINE(args) == ENGINE_FORK)) {
         fprintf(stderr, "Could not initialize semaphores\n");
         goto sem_error;
     }
+    uint64_t start = now_ns();
+    trace.start = start;
 
-    // Counter of spawned processes
-    unsigned long spawned = 0;
-
-    // Children pid array
-    pid_t* pids = malloc(sizeof(pid_t) * (args.no + args.nh));
-    if (pids == NULL) {
-        fprintf(stderr, "Malloc error\n");
-        goto malloc_error;
-    }
-
-    // Check if at least one molecule can be created
-    if (args.no == 0 || args.nh < 2) {
-        shared->not_enough = true;
-        sem_post(&shared->semaphores[SEM_OXYGEN_QUEUE]);
-        sem_post(&shared->semaphores[SEM_HYDROGEN_QUEUE]);
-    }
-
-    // Spawn oxygen processes
-    for (unsigned long i = 0; i < args.no; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            free(pids);  // Cleanup in child
-            oxygen_process(i + 1, args);
-            return 0;
-        } else if (pid == -1) {
-            goto fork_error;
-        } else {
-            pids[spawned] = pid;
+    // Reactors which can't create any molecule release their atoms right away
+    for (uint32_t i = 0; i < shared->reactor_count && !stream.enabled; i++) {
+        reactor = &shared->reactors[i];
+        if (reactor->molecules == 0) {
+            wake_leftovers();
         }
-        spawned++;
     }
+    reactor = &shared->reactors[0];
 
-    // Spawn hydrogen processes
-    for (unsigned long i = 0; i < args.nh; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            free(pids);  // Cleanup in child
-            hydrogen_process(i + 1, args);
-            return 0;
-        } else if (pid == -1) {
-            goto fork_error;
-        } else {
-            pids[spawned] = pid;
-        }
-        spawned++;
+    // Run all atoms
+    bool success = false;
+    switch (ENGINE(args)) {
+        case ENGINE_FORK:
+            success = args.spawners > 0 ? run_fork_tree_engine(args) : run_fork_engine(args);
+            break;
+        case ENGINE_THREADS:
+            success = stream.enabled ? run_stream_engine(args) : run_thread_engine(args);
+            break;
+        case ENGINE_POOL:
+            success = run_pool_engine(args);
+            break;
     }
-
-    // Wait for all children to end
-    for (uint32_t i = 0; i < spawned; i++) {
-        wait(NULL);
+    if (!success) {
+        goto engine_error;
     }
 
-    // Cleanup
-    free(pids);
+    // Cleanup (teardown is timed from the end of the last atom, segment is already unlinked)
+    close_metrics();
     close_log();
     destroy_semaphores();
-    destroy_shared();
+    uint64_t end = now_ns();
+    instrument_report();
+    if (args.rusage) {
+        reap_report(args);
+    }
+    if (trace.output != NULL && !trace_write(args)) {
+        fprintf(stderr, "Could not write trace %s\n", trace.output);
+    }
+    if (bench.enabled) {
+        uint64_t ended = shared->atoms_ended_at;
+        bench_report(args, end - start, ended != 0 && ended < end ? end - ended : 0);
+    }
+    close_replay();
 
     return 0;
 
-// Error handling section
-fork_error:
-    fprintf(stderr, "Fork error\n");
-
-    // Kill all children
-    for (uint32_t i = 0; i < spawned; i++) {
-        kill(pids[i], SIGKILL);
-    }
-    free(pids);
-
-    // Cleanup
-malloc_error:
+    // Error handling section
+engine_error:
 sem_error:
     destroy_semaphores();
 log_error:
     close_log();
 shared_error:
-    destroy_shared();
+    close_metrics();
+    close_replay();
 
     return 1;
 }
@@ -0,0 +1,576 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+/**
+ * @file sync.h
+ * @brief Synchronization primitives (mutex, counting semaphore, barrier, group)
+ *
+ * Backend is selected at build time:
+ *  - POSIX unnamed semaphores (default)
+ *  - Linux futexes (SYNC_FUTEX defined), uncontended operations stay in userspace
+ *
+ * All primitives can be placed in shared memory and used by more processes
+ * when initialized with pshared set.
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Number of spins before a barrier or group waiter parks in the kernel
+#define SYNC_BARRIER_SPINS 128
+
+/**
+ * Spin loop hint
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Wait on futex while it contains expected value
+ *
+ * @param word Futex word
+ * @param expected Expected value
+ * @param flags 0 or FUTEX_PRIVATE_FLAG
+ */
+static inline void futex_wait(uint32_t* word, uint32_t expected, uint32_t flags) {
+    syscall(SYS_futex, word, FUTEX_WAIT | flags, expected, NULL, NULL, 0);
+}
+
+/**
+ * Wake waiters of futex
+ *
+ * @param word Futex word
+ * @param count Maximal number of woken waiters
+ * @param flags 0 or FUTEX_PRIVATE_FLAG
+ */
+static inline void futex_wake(uint32_t* word, int count, uint32_t flags) {
+    syscall(SYS_futex, word, FUTEX_WAKE | flags, count, NULL, NULL, 0);
+}
+
+#ifdef SYNC_FUTEX
+
+#define SYNC_BACKEND "futex"
+
+// Counting semaphore
+typedef struct sync_sem {
+    uint32_t value;    // Semaphore value (futex word)
+    uint32_t waiters;  // Number of parked waiters
+    uint32_t flags;    // Futex flags (private or shared)
+} sync_sem_t;
+
+// Mutex (0 unlocked, 1 locked, 2 locked with waiters)
+typedef struct sync_mutex {
+    uint32_t state;  // Mutex state (futex word)
+    uint32_t flags;  // Futex flags (private or shared)
+} sync_mutex_t;
+
+// Reusable barrier
+typedef struct sync_barrier {
+    uint32_t parties;     // Number of participants
+    uint32_t count;       // Number of arrived participants in current phase
+    uint32_t generation;  // Phase number, incremented by last participant (futex word)
+    uint32_t waiters;     // Number of participants parked in the kernel
+    uint32_t flags;       // Futex flags (private or shared)
+} sync_barrier_t;
+
+// Group led by one participant which releases all followers phase by phase
+typedef struct sync_group {
+    uint32_t followers;      // Number of participants besides leader
+    uint32_t epoch;          // Number of released phases (futex word of followers)
+    uint32_t arrived;        // Followers done with current phase (futex word of leader)
+    uint32_t waiters;        // Number of followers parked in the kernel
+    uint32_t leader_parked;  // Leader is parked in the kernel
+    uint32_t flags;          // Futex flags (private or shared)
+} sync_group_t;
+
+static inline bool sync_sem_init(sync_sem_t* sem, bool pshared, uint32_t value) {
+    sem->value = value;
+    sem->waiters = 0;
+    sem->flags = pshared ? 0 : FUTEX_PRIVATE_FLAG;
+    return true;
+}
+
+static inline void sync_sem_destroy(sync_sem_t* sem) {
+    (void)sem;
+}
+
+static inline void sync_sem_wait(sync_sem_t* sem) {
+    while (true) {
+        uint32_t value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+        while (value > 0) {
+            if (__atomic_compare_exchange_n(&sem->value, &value, value - 1, true, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+        __atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&sem->value, 0, sem->flags);
+        __atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline bool sync_sem_trywait(sync_sem_t* sem) {
+    uint32_t value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+    while (value > 0) {
+        if (__atomic_compare_exchange_n(&sem->value, &value, value - 1, true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void sync_sem_post(sync_sem_t* sem) {
+    __atomic_add_fetch(&sem->value, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&sem->value, 1, sem->flags);
+    }
+}
+
+/**
+ * @brief Post semaphore count times at once
+ *
+ * Value is raised by one atomic add and all waiters are woken by one FUTEX_WAKE.
+ *
+ * @param sem Semaphore
+ * @param count Number of posts
+ */
+static inline void sync_sem_post_n(sync_sem_t* sem, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    __atomic_add_fetch(&sem->value, count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&sem->value, count < INT_MAX ? (int)count : INT_MAX, sem->flags);
+    }
+}
+
+static inline bool sync_mutex_init(sync_mutex_t* mutex, bool pshared) {
+    mutex->state = 0;
+    mutex->flags = pshared ? 0 : FUTEX_PRIVATE_FLAG;
+    return true;
+}
+
+static inline void sync_mutex_destroy(sync_mutex_t* mutex) {
+    (void)mutex;
+}
+
+static inline void sync_mutex_lock(sync_mutex_t* mutex) {
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &state, 1, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (state != 2) {
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0) {
+        futex_wait(&mutex->state, 2, mutex->flags);
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline bool sync_mutex_trylock(sync_mutex_t* mutex) {
+    uint32_t state = 0;
+    return __atomic_compare_exchange_n(&mutex->state, &state, 1, false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+static inline void sync_mutex_unlock(sync_mutex_t* mutex) {
+    if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+        futex_wake(&mutex->state, 1, mutex->flags);
+    }
+}
+
+static inline bool sync_barrier_init(sync_barrier_t* barrier, bool pshared, uint32_t parties) {
+    barrier->parties = parties;
+    barrier->count = 0;
+    barrier->generation = 0;
+    barrier->waiters = 0;
+    barrier->flags = pshared ? 0 : FUTEX_PRIVATE_FLAG;
+    return true;
+}
+
+static inline void sync_barrier_destroy(sync_barrier_t* barrier) {
+    (void)barrier;
+}
+
+/**
+ * @brief Wait until all participants arrive to barrier
+ *
+ * Spins for a short while and then parks in the kernel, the last participant
+ * issues FUTEX_WAKE only if somebody is parked.
+ *
+ * @param barrier Barrier
+ */
+static inline void sync_barrier_wait(sync_barrier_t* barrier) {
+    uint32_t generation = __atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&barrier->count, 1, __ATOMIC_ACQ_REL) == barrier->parties) {
+        __atomic_store_n(&barrier->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->generation, generation + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&barrier->waiters, __ATOMIC_SEQ_CST) > 0) {
+            futex_wake(&barrier->generation, INT_MAX, barrier->flags);
+        }
+        return;
+    }
+
+    for (int i = 0; i < SYNC_BARRIER_SPINS; i++) {
+        if (__atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE) != generation) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    __atomic_add_fetch(&barrier->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&barrier->generation, __ATOMIC_SEQ_CST) == generation) {
+        futex_wait(&barrier->generation, generation, barrier->flags);
+    }
+    __atomic_sub_fetch(&barrier->waiters, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool sync_group_init(sync_group_t* group, bool pshared, uint32_t followers) {
+    group->followers = followers;
+    group->epoch = 0;
+    group->arrived = 0;
+    group->waiters = 0;
+    group->leader_parked = 0;
+    group->flags = pshared ? 0 : FUTEX_PRIVATE_FLAG;
+    return true;
+}
+
+static inline void sync_group_destroy(sync_group_t* group) {
+    (void)group;
+}
+
+/**
+ * @brief Get round of group the follower takes part in
+ *
+ * Every round has two phases (even epoch starts a round), so followers may
+ * join any time before their first arrival.
+ *
+ * @param group Group
+ * @return Round token for sync_group_wait()
+ */
+static inline uint32_t sync_group_round(sync_group_t* group) {
+    return __atomic_load_n(&group->epoch, __ATOMIC_ACQUIRE) & ~1u;
+}
+
+/**
+ * @brief Release all followers to the next phase (leader)
+ *
+ * One FUTEX_WAKE wakes all of them, issued only if somebody is parked.
+ *
+ * @param group Group
+ */
+static inline void sync_group_release(sync_group_t* group) {
+    __atomic_add_fetch(&group->epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&group->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&group->epoch, INT_MAX, group->flags);
+    }
+}
+
+/**
+ * Wait until phase of round is released (follower)
+ *
+ * @param group Group
+ * @param round Round token from sync_group_round()
+ * @param phase Phase of round (1 or 2)
+ */
+static inline void sync_group_wait(sync_group_t* group, uint32_t round, uint32_t phase) {
+    for (int i = 0; i < SYNC_BARRIER_SPINS; i++) {
+        if (__atomic_load_n(&group->epoch, __ATOMIC_ACQUIRE) - round >= phase) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    __atomic_add_fetch(&group->waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t epoch;
+    while ((epoch = __atomic_load_n(&group->epoch, __ATOMIC_SEQ_CST)) - round < phase) {
+        futex_wait(&group->epoch, epoch, group->flags);
+    }
+    __atomic_sub_fetch(&group->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Report current phase done (follower), the last one wakes parked leader
+ *
+ * @param group Group
+ */
+static inline void sync_group_arrive(sync_group_t* group) {
+    if (__atomic_add_fetch(&group->arrived, 1, __ATOMIC_SEQ_CST) == group->followers &&
+        __atomic_load_n(&group->leader_parked, __ATOMIC_SEQ_CST)) {
+        futex_wake(&group->arrived, 1, group->flags);
+    }
+}
+
+/**
+ * Wait until all followers are done with current phase (leader)
+ *
+ * @param group Group
+ */
+static inline void sync_group_collect(sync_group_t* group) {
+    for (int i = 0; i < SYNC_BARRIER_SPINS; i++) {
+        if (__atomic_load_n(&group->arrived, __ATOMIC_ACQUIRE) == group->followers) {
+            __atomic_store_n(&group->arrived, 0, __ATOMIC_RELAXED);
+            return;
+        }
+        cpu_relax();
+    }
+
+    __atomic_store_n(&group->leader_parked, 1, __ATOMIC_SEQ_CST);
+    uint32_t arrived;
+    while ((arrived = __atomic_load_n(&group->arrived, __ATOMIC_SEQ_CST)) != group->followers) {
+        futex_wait(&group->arrived, arrived, group->flags);
+    }
+    __atomic_store_n(&group->leader_parked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&group->arrived, 0, __ATOMIC_RELAXED);
+}
+
+#else
+
+#define SYNC_BACKEND "posix"
+
+// Counting semaphore
+typedef struct sync_sem {
+    sem_t sem;  // POSIX semaphore
+} sync_sem_t;
+
+// Mutex (binary semaphore)
+typedef struct sync_mutex {
+    sem_t sem;  // POSIX semaphore
+} sync_mutex_t;
+
+// Reusable barrier
+typedef struct sync_barrier {
+    uint32_t parties;  // Number of participants
+    uint32_t count;    // Number of arrived participants
+    sem_t mutex;       // Protects count
+    sem_t turnstile;   // First turnstile
+    sem_t turnstile2;  // Second turnstile
+} sync_barrier_t;
+
+// Group led by one participant which releases all followers phase by phase
+typedef struct sync_group {
+    uint32_t followers;  // Number of participants besides leader
+    uint32_t released;   // Number of released phases (written by leader only)
+    sem_t release[2];    // Posted once for every follower by leader (odd and even phases)
+    sem_t arrived;       // Posted by every follower done with phase
+} sync_group_t;
+
+static inline bool sync_sem_init(sync_sem_t* sem, bool pshared, uint32_t value) {
+    return sem_init(&sem->sem, pshared, value) == 0;
+}
+
+static inline void sync_sem_destroy(sync_sem_t* sem) {
+    sem_destroy(&sem->sem);
+}
+
+static inline void sync_sem_wait(sync_sem_t* sem) {
+    sem_wait(&sem->sem);
+}
+
+static inline bool sync_sem_trywait(sync_sem_t* sem) {
+    return sem_trywait(&sem->sem) == 0;
+}
+
+static inline void sync_sem_post(sync_sem_t* sem) {
+    sem_post(&sem->sem);
+}
+
+/**
+ * @brief Post semaphore count times at once
+ *
+ * POSIX semaphores have no batch post, every waiter is still woken directly
+ * by the caller.
+ *
+ * @param sem Semaphore
+ * @param count Number of posts
+ */
+static inline void sync_sem_post_n(sync_sem_t* sem, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        sem_post(&sem->sem);
+    }
+}
+
+static inline bool sync_mutex_init(sync_mutex_t* mutex, bool pshared) {
+    return sem_init(&mutex->sem, pshared, 1) == 0;
+}
+
+static inline void sync_mutex_destroy(sync_mutex_t* mutex) {
+    sem_destroy(&mutex->sem);
+}
+
+static inline void sync_mutex_lock(sync_mutex_t* mutex) {
+    sem_wait(&mutex->sem);
+}
+
+static inline bool sync_mutex_trylock(sync_mutex_t* mutex) {
+    return sem_trywait(&mutex->sem) == 0;
+}
+
+static inline void sync_mutex_unlock(sync_mutex_t* mutex) {
+    sem_post(&mutex->sem);
+}
+
+static inline bool sync_barrier_init(sync_barrier_t* barrier, bool pshared, uint32_t parties) {
+    barrier->parties = parties;
+    barrier->count = 0;
+    return sem_init(&barrier->mutex, pshared, 1) == 0 &&
+           sem_init(&barrier->turnstile, pshared, 0) == 0 &&
+           sem_init(&barrier->turnstile2, pshared, 1) == 0;
+}
+
+static inline void sync_barrier_destroy(sync_barrier_t* barrier) {
+    sem_destroy(&barrier->mutex);
+    sem_destroy(&barrier->turnstile);
+    sem_destroy(&barrier->turnstile2);
+}
+
+/**
+ * @brief Reusable barrier
+ *
+ * Implemented from Little book of semaphores
+ * 3.7.5
+ *
+ * @param barrier Barrier
+ */
+static inline void sync_barrier_wait(sync_barrier_t* barrier) {
+    sem_wait(&barrier->mutex);
+    barrier->count++;
+    if (barrier->count == barrier->parties) {
+        sem_wait(&barrier->turnstile2);
+        sem_post(&barrier->turnstile);
+    }
+    sem_post(&barrier->mutex);
+    sem_wait(&barrier->turnstile);
+    sem_post(&barrier->turnstile);
+    sem_wait(&barrier->mutex);
+    barrier->count--;
+    if (barrier->count == 0) {
+        sem_wait(&barrier->turnstile);
+        sem_post(&barrier->turnstile2);
+    }
+    sem_post(&barrier->mutex);
+    sem_wait(&barrier->turnstile2);
+    sem_post(&barrier->turnstile2);
+}
+
+static inline bool sync_group_init(sync_group_t* group, bool pshared, uint32_t followers) {
+    group->followers = followers;
+    group->released = 0;
+    return sem_init(&group->release[0], pshared, 0) == 0 &&
+           sem_init(&group->release[1], pshared, 0) == 0 &&
+           sem_init(&group->arrived, pshared, 0) == 0;
+}
+
+static inline void sync_group_destroy(sync_group_t* group) {
+    sem_destroy(&group->release[0]);
+    sem_destroy(&group->release[1]);
+    sem_destroy(&group->arrived);
+}
+
+/**
+ * @brief Get round of group the follower takes part in
+ *
+ * Phases are told apart by their release semaphores, round is not needed.
+ *
+ * @param group Group
+ * @return Round token for sync_group_wait()
+ */
+static inline uint32_t sync_group_round(sync_group_t* group) {
+    (void)group;
+    return 0;
+}
+
+/**
+ * Release all followers to the next phase (leader)
+ *
+ * @param group Group
+ */
+static inline void sync_group_release(sync_group_t* group) {
+    sem_t* release = &group->release[group->released++ & 1];
+    for (uint32_t i = 0; i < group->followers; i++) {
+        sem_post(release);
+    }
+}
+
+/**
+ * @brief Wait until phase of round is released (follower)
+ *
+ * Odd and even phases are posted to different semaphores and leader begins
+ * a phase only after all followers arrived from the previous one, so no
+ * follower can take a post meant for another phase.
+ *
+ * @param group Group
+ * @param round Round token from sync_group_round()
+ * @param phase Phase of round (1 or 2)
+ */
+static inline void sync_group_wait(sync_group_t* group, uint32_t round, uint32_t phase) {
+    (void)round;
+    sem_wait(&group->release[(phase - 1) & 1]);
+}
+
+/**
+ * Report current phase done (follower)
+ *
+ * @param group Group
+ */
+static inline void sync_group_arrive(sync_group_t* group) {
+    sem_post(&group->arrived);
+}
+
+/**
+ * Wait until all followers are done with current phase (leader)
+ *
+ * @param group Group
+ */
+static inline void sync_group_collect(sync_group_t* group) {
+    for (uint32_t i = 0; i < group->followers; i++) {
+        sem_wait(&group->arrived);
+    }
+}
+
+#endif
+
+/**
+ * @brief Wait on semaphore, spinning and yielding before it blocks
+ *
+ * Semaphore is polled spins times with a pause between polls, then once
+ * after each of yields sched_yield() calls, only then the waiter blocks.
+ *
+ * @param sem Semaphore
+ * @param spins Number of spinning polls
+ * @param yields Number of yielding polls
+ * @return Number of failed polls (spins + yields if the waiter blocked)
+ */
+static inline uint32_t sync_sem_wait_spin(sync_sem_t* sem, uint32_t spins, uint32_t yields) {
+    for (uint32_t i = 0; i < spins; i++) {
+        if (sync_sem_trywait(sem)) {
+            return i;
+        }
+        cpu_relax();
+    }
+    for (uint32_t i = 0; i < yields; i++) {
+        if (sync_sem_trywait(sem)) {
+            return spins + i;
+        }
+        sched_yield();
+    }
+    sync_sem_wait(sem);
+    return spins + yields;
+}
+
+#endif